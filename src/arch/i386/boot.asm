@@ -189,58 +189,63 @@ irq_common_stub:
   sti
   iret           ; pops 5 things at once: CS, EIP, EFLAGS, SS, and ESP
 
-global copy_page_physical
-copy_page_physical:
-  push ebx              ; According to __cdecl, we must preserve the contents of EBX.
-  pushf                 ; push EFLAGS, so we can pop it and reenable interrupts
-  ; later, if they were enabled anyway.
-  cli                   ; Disable interrupts, so we aren't interrupted.
-  ; Load these in BEFORE we disable paging!
-  mov ebx, [esp+12]     ; Source address
-  mov ecx, [esp+16]     ; Destination address
-
-  mov edx, cr0          ; Get the control register...
-  and edx, 0x7fffffff   ; and...
-  mov cr0, edx          ; Disable paging.
-
-  mov edx, 1024         ; 1024*4bytes = 4096 bytes to copy
-
-  .loop:
-  mov eax, [ebx]        ; Get the word at the source address
-  mov [ecx], eax        ; Store it at the dest address
-  add ebx, 4            ; Source address += sizeof(word)
-  add ecx, 4            ; Dest address += sizeof(word)
-  dec edx               ; One less word to do
-  jnz .loop
-
-  mov edx, cr0          ; Get the control register again
-  or  edx, 0x80000000   ; and...
-  mov cr0, edx          ; Enable paging.
-
-  popf                  ; Pop EFLAGS back.
-  pop ebx               ; Get the original value of EBX back.
+; void switch_context(u32int *prev_esp, u32int next_esp, u32int next_directory)
+; Saves the callee-saved registers on the current stack and its pointer in
+; *prev_esp, then resumes the task whose frame is at next_esp.
+global switch_context
+switch_context:
+  push ebp
+  push ebx
+  push esi
+  push edi
+
+  mov eax, [esp + 20]
+  mov edx, [esp + 24]
+  mov ecx, [esp + 28]
+  mov [eax], esp
+
+  ; Every task's stack lives at the same address in its own directory,
+  ; so the directory has to change before the stack does. Tasks sharing
+  ; a directory keep their TLB entries.
+  mov eax, cr3
+  cmp eax, ecx
+  je .same_directory
+  mov cr3, ecx
+.same_directory:
+  mov esp, edx
+
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  ; A forked child returns 0 from fork_context() through here.
+  xor eax, eax
   ret
 
-global read_eip
-read_eip:
-  pop eax
-  jmp eax
-
-global do_fucking_jump
-do_fucking_jump:
-
-  mov ecx, [esp + 4]
-  mov ebp, [esp + 8]
-  mov eax, [esp + 12]
-  mov ebx, [esp + 16]
-
-  mov esp, eax
-  mov eax, 12345h
-
-  mov cr3, ebx
+; int fork_context(task_t *child)
+; Pushes the frame the child will be resumed from and hands it to
+; fork_finish(), which copies the stack along with the directory.
+; Returns 1 in the parent and 0 in the child.
+extern fork_finish
+global fork_context
+fork_context:
+  mov eax, [esp + 4]
+  push ebp
+  push ebx
+  push esi
+  push edi
 
-  sti
-  jmp ecx
+  push esp
+  push eax
+  call fork_finish
+  add esp, 8
+
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  mov eax, 1
+  ret
 
 global tss_flush
 tss_flush:
@@ -0,0 +1,397 @@
+// bench.c -- Boot-time microbenchmarks.
+
+#include "bench.h"
+#include "buddy.h"
+#include "kheap.h"
+#include "monitor.h"
+#include "paging.h"
+#include "task.h"
+#include "timer.h"
+#include "vma.h"
+#include "vmem.h"
+
+extern page_directory_t *current_directory;
+extern volatile task_t *current_task;
+
+// Low half of the time stamp counter. Everything measured here takes far
+// less than 2^32 cycles, so differences are right across a wrap.
+static u32int rdtsc() {
+  u32int lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return lo;
+}
+
+static void report(char *what, u32int n, char *unit, u32int cycles) {
+  monitor_write(what);
+  monitor_write(" ");
+  monitor_write_dec(n);
+  monitor_write(unit);
+  monitor_write(": ");
+  monitor_write_dec(cycles);
+  monitor_write(" cycles\n");
+}
+
+static u32int seed = 1;
+
+static u32int random() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+// Mixed-size allocations and frees against a fragmented heap: slots
+// blocks of 16 to 216 bytes, every other one freed before timing starts.
+#define CHURN_SLOTS 20000
+#define CHURN_OPS 100000
+
+static void bench_heap_churn() {
+  u32int *slots = (u32int*)kmalloc(CHURN_SLOTS * sizeof(u32int));
+  u32int i;
+
+  for (i = 0; i < CHURN_SLOTS; i++) {
+    slots[i] = kmalloc(16 + random() % 200);
+  }
+  for (i = 0; i < CHURN_SLOTS; i += 2) {
+    kfree(slots[i]);
+    slots[i] = 0;
+  }
+
+  asm volatile("cli");
+  u32int start = rdtsc();
+  for (i = 0; i < CHURN_OPS; i++) {
+    u32int j = (random() % (CHURN_SLOTS / 2)) * 2;
+    if (slots[j]) {
+      kfree(slots[j]);
+      slots[j] = 0;
+    } else {
+      slots[j] = kmalloc(16 + random() % 200);
+    }
+  }
+  u32int cycles = rdtsc() - start;
+  asm volatile("sti");
+
+  for (i = 0; i < CHURN_SLOTS; i++) {
+    if (slots[i]) {
+      kfree(slots[i]);
+    }
+  }
+  kfree((u32int)slots);
+
+  report("heap churn, average of", CHURN_OPS, " kmalloc/kfree", cycles / CHURN_OPS);
+}
+
+// Each timed kfree() merges with a hole on either side, while the heap
+// holds about holes other holes.
+#define KFREE_BLOCK 32
+#define KFREE_TIMED 1000
+
+static void bench_kfree(u32int holes) {
+  u32int count = 2 * (holes + KFREE_TIMED) + 1;
+  u32int *blocks = (u32int*)kmalloc(count * sizeof(u32int));
+  u32int i;
+
+  for (i = 0; i < count; i++) {
+    blocks[i] = kmalloc(KFREE_BLOCK);
+  }
+  // The even blocks become holes, kept apart by the odd ones.
+  for (i = 0; i < count; i += 2) {
+    kfree(blocks[i]);
+  }
+
+  asm volatile("cli");
+  u32int start = rdtsc();
+  for (i = 1; i < 2 * KFREE_TIMED; i += 2) {
+    kfree(blocks[i]);
+  }
+  u32int cycles = rdtsc() - start;
+  asm volatile("sti");
+
+  for (; i < count; i += 2) {
+    kfree(blocks[i]);
+  }
+  kfree((u32int)blocks);
+
+  report("kfree with", holes, " holes", cycles / KFREE_TIMED);
+}
+
+// Times clone_directory(), the part of fork() that depends on the size
+// of the address space, with pages resident in the current task.
+static void bench_clone(u32int pages) {
+  u32int addr = mmap(0, pages * 0x1000);
+  ASSERT(addr != 0);
+  u32int i;
+  for (i = 0; i < pages; i++) {
+    *(u32int*)(addr + i * 0x1000) = i;
+  }
+
+  asm volatile("cli");
+  u32int start = rdtsc();
+  page_directory_t *dir = clone_directory(current_directory);
+  u32int cycles = rdtsc() - start;
+  asm volatile("sti");
+
+  free_directory(dir);
+  munmap(addr, pages * 0x1000);
+
+  report("fork with", pages, " resident pages", cycles);
+}
+
+// Average cost of copy_page_physical() between two frames.
+#define COPY_PAGES 1000
+
+static void bench_copy() {
+  u32int src = alloc_frames(0);
+  u32int dst = alloc_frames(0);
+  ASSERT(src != (u32int)-1 && dst != (u32int)-1);
+
+  u32int i;
+  u32int start = rdtsc();
+  for (i = 0; i < COPY_PAGES; i++) {
+    copy_page_physical(src * 0x1000, dst * 0x1000);
+  }
+  u32int cycles = rdtsc() - start;
+
+  free_frames(src, 0);
+  free_frames(dst, 0);
+
+  report("page copy, average of", COPY_PAGES, " copies", cycles / COPY_PAGES);
+}
+
+// Kernel pages touched after each kind of flush. Small enough that the
+// whole set fits in the TLB.
+#define TLB_PAGES 32
+
+static u32int touch_pages(u32int addr) {
+  u32int i, start = rdtsc();
+  for (i = 0; i < TLB_PAGES; i++) {
+    (void)*(volatile u32int*)(addr + i * 0x1000);
+  }
+  return rdtsc() - start;
+}
+
+// What a task switch costs the kernel's TLB entries. Reloading CR3, as a
+// switch between directories does, keeps global entries; toggling
+// CR4.PGE drops them as well, which is what every switch did before
+// kernel pages were global.
+static void bench_tlb() {
+  u32int addr = alloc_pages(TLB_PAGES);
+  u32int cr3, cr4;
+  asm volatile("cli");
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+  touch_pages(addr);
+
+  asm volatile("mov %%cr3, %0" : "=r"(cr3));
+  asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+  u32int kept = touch_pages(addr);
+
+  asm volatile("mov %0, %%cr4" : : "r"(cr4 & ~0x80) : "memory");
+  asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+  u32int flushed = touch_pages(addr);
+  asm volatile("sti");
+
+  free_pages(addr);
+
+  if (!(cr4 & 0x80)) {
+    monitor_write("no global pages on this CPU\n");
+  }
+  report("kernel page touches after CR3 reload,", TLB_PAGES, " pages", kept);
+  report("kernel page touches after full flush,", TLB_PAGES, " pages", flushed);
+}
+
+// Round trips between two tasks in different directories, so every
+// switch goes through switch_context() and reloads CR3.
+#define PING_PONGS 10000
+
+static void bench_switch() {
+  // Heap memory is mapped the same in every directory, unlike globals
+  // after the fork.
+  volatile u32int *done = (volatile u32int*)kmalloc(sizeof(u32int));
+  *done = 0;
+
+  // Nothing else runs at the top priority, so the two tasks just take
+  // turns.
+  set_priority(0);
+  if (fork() == 0) {
+    asm volatile("cli");
+    while (!*done) {
+      switch_task();
+    }
+    exit_task();
+  }
+
+  u32int i;
+  asm volatile("cli");
+  u32int start = rdtsc();
+  for (i = 0; i < PING_PONGS; i++) {
+    switch_task();
+  }
+  u32int cycles = rdtsc() - start;
+  *done = 1;
+  switch_task();
+  asm volatile("sti");
+
+  set_priority(DEFAULT_PRIORITY);
+  kfree((u32int)done);
+
+  report("task switch, average of", 2 * PING_PONGS, " switches",
+      cycles / (2 * PING_PONGS));
+}
+
+// One task that sleeps and is woken once a tick, beside busy tasks that
+// only spin. Wake latency is from wake_task() to the sleeper running
+// again; throughput is how far the busy tasks get meanwhile.
+#define WAKE_TICKS 64
+
+// Shared by the tasks of one run; it lives on the heap so every
+// directory sees it.
+typedef struct {
+  u32int done;
+  u32int live;        // Children that haven't exited yet.
+  u32int start, end;  // Ticks.
+  u32int spins;
+  task_t *bench;
+  task_t *sleeper;
+  u32int woken_at;
+  u32int wakeups;
+  u32int latency;     // Sum, in cycles. Wakeups never overlap, so it
+                      // stays below the length of the run.
+  u32int worst;
+} wake_bench_t;
+
+static u32int ticks_now() {
+  return *(volatile u32int*)&tick;
+}
+
+static void wake_child_exit(volatile wake_bench_t *s) {
+  asm volatile("cli");
+  if (--s->live == 0) {
+    wake_task(s->bench);
+  }
+  exit_task();
+}
+
+// The first busy task also keeps time: it wakes the sleeper on every new
+// tick and ends the run.
+static void wake_busy(volatile wake_bench_t *s, int waker) {
+  u32int last = ticks_now();
+  while (!s->done) {
+    s->spins++;
+    if (!waker || ticks_now() == last) {
+      continue;
+    }
+    last = ticks_now();
+    asm volatile("cli");
+    if (last - s->start >= WAKE_TICKS) {
+      s->end = last;
+      s->done = 1;
+      if (s->sleeper && s->sleeper->state == TASK_BLOCKED) {
+        wake_task(s->sleeper);
+      }
+    } else if (s->sleeper && s->sleeper->state == TASK_BLOCKED) {
+      s->woken_at = rdtsc();
+      wake_task(s->sleeper);
+    }
+    asm volatile("sti");
+  }
+  wake_child_exit(s);
+}
+
+static void wake_sleeper(volatile wake_bench_t *s) {
+  s->sleeper = (task_t*)current_task;
+  // Checking done and blocking with interrupts off means the waker
+  // either sees us blocked or we see done.
+  asm volatile("cli");
+  while (!s->done) {
+    block_task();
+    asm volatile("cli");
+    if (s->done) {
+      break;
+    }
+    u32int cycles = rdtsc() - s->woken_at;
+    s->latency += cycles;
+    if (cycles > s->worst) {
+      s->worst = cycles;
+    }
+    s->wakeups++;
+  }
+  wake_child_exit(s);
+}
+
+static void bench_wake(int busy, int sleeper) {
+  volatile wake_bench_t *s =
+      (volatile wake_bench_t*)kmalloc(sizeof(wake_bench_t));
+  memset((void*)s, 0, sizeof(wake_bench_t));
+  s->bench = (task_t*)current_task;
+  s->live = busy + sleeper;
+  s->start = ticks_now();
+
+  int i;
+  for (i = 0; i < busy; i++) {
+    if (fork() == 0) {
+      wake_busy(s, i == 0);
+    }
+  }
+  if (sleeper && fork() == 0) {
+    wake_sleeper(s);
+  }
+
+  // The last child to exit wakes us.
+  asm volatile("cli");
+  while (s->live) {
+    block_task();
+    asm volatile("cli");
+  }
+  asm volatile("sti");
+
+  monitor_write("busy spins per tick, ");
+  monitor_write_dec(busy);
+  monitor_write(sleeper ? " busy tasks and a sleeper: " : " busy tasks: ");
+  monitor_write_dec(s->spins / (s->end - s->start));
+  monitor_write("\n");
+  if (sleeper && s->wakeups) {
+    report("wake latency, average of", s->wakeups, " wakeups",
+        s->latency / s->wakeups);
+    report("wake latency, worst of", s->wakeups, " wakeups", s->worst);
+  }
+  kfree((u32int)s);
+}
+
+// Sleeps while nothing else runs, so only the idle task is left. With
+// the tick stopped in idle, the timer should interrupt far less often
+// than once a tick.
+#define IDLE_TICKS 100
+
+static void bench_idle() {
+  u32int interrupts = timer_interrupts;
+  u32int wakeups = get_idle_wakeups();
+  u32int start = ticks_now();
+  sleep_task(IDLE_TICKS);
+  u32int ticks = ticks_now() - start;
+
+  monitor_write("idle ");
+  monitor_write_dec(ticks);
+  monitor_write(" ticks: timer interrupts ");
+  monitor_write_dec(interrupts);
+  monitor_write(" -> ");
+  monitor_write_dec(timer_interrupts);
+  monitor_write(", idle wakeups ");
+  monitor_write_dec(wakeups);
+  monitor_write(" -> ");
+  monitor_write_dec(get_idle_wakeups());
+  monitor_write("\n");
+}
+
+void run_benchmarks() {
+  bench_heap_churn();
+  bench_kfree(1000);
+  bench_kfree(4000);
+  bench_kfree(16000);
+  bench_clone(16);
+  bench_clone(256);
+  bench_clone(1024);
+  bench_copy();
+  bench_tlb();
+  bench_switch();
+  bench_wake(3, 0);
+  bench_wake(3, 1);
+  bench_idle();
+}
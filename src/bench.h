@@ -0,0 +1,16 @@
+// bench.h -- Boot-time microbenchmarks. They are only built in with
+//            `make BENCH=1`, and then run from kernel_main(), printing
+//            their cycle counts to the monitor.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "common.h"
+
+/**
+   Runs every benchmark in turn. Must be called from ring 0 with tasking
+   initialised.
+**/
+void run_benchmarks();
+
+#endif // BENCH_H
@@ -0,0 +1,169 @@
+// buddy.c -- Binary buddy allocator for physical frames.
+//
+// Rather than linking free blocks through memory we can't address, every
+// order has a bitmap with one bit per block, set while that block is
+// free (and not merged into a bigger one). A summary bitmap on top, one
+// bit per word that has anything free in it, lets a search skip 1024
+// blocks per word it looks at, and it starts where the last one of the
+// same order left off.
+
+#include "buddy.h"
+#include "kheap.h"
+
+#define INDEX_FROM_BIT(a) ((a)/(8*4))
+#define OFFSET_FROM_BIT(a) ((a)%(8*4))
+
+static u32int *free_map[BUDDY_MAX_ORDER + 1];
+static u32int *free_summary[BUDDY_MAX_ORDER + 1];
+static u32int free_blocks[BUDDY_MAX_ORDER + 1];
+static u32int nblocks[BUDDY_MAX_ORDER + 1];
+static u32int hint[BUDDY_MAX_ORDER + 1];
+
+static void mark_free(u32int order, u32int block)
+{
+    u32int idx = INDEX_FROM_BIT(block);
+    free_map[order][idx] |= (0x1 << OFFSET_FROM_BIT(block));
+    free_summary[order][INDEX_FROM_BIT(idx)] |= (0x1 << OFFSET_FROM_BIT(idx));
+    free_blocks[order]++;
+}
+
+static void mark_used(u32int order, u32int block)
+{
+    u32int idx = INDEX_FROM_BIT(block);
+    free_map[order][idx] &= ~(0x1 << OFFSET_FROM_BIT(block));
+    if (free_map[order][idx] == 0)
+    {
+        free_summary[order][INDEX_FROM_BIT(idx)] &= ~(0x1 << OFFSET_FROM_BIT(idx));
+    }
+    free_blocks[order]--;
+}
+
+static int is_free(u32int order, u32int block)
+{
+    return block < nblocks[order] &&
+        (free_map[order][INDEX_FROM_BIT(block)] & (0x1 << OFFSET_FROM_BIT(block)));
+}
+
+// Find the first word of free_map[order] in [from, to) with a free block
+// in it, or return (u32int)-1.
+static u32int first_free_word(u32int order, u32int from, u32int to)
+{
+    while (from < to)
+    {
+        u32int s = INDEX_FROM_BIT(from);
+        u32int candidates = free_summary[order][s] & (0xFFFFFFFF << OFFSET_FROM_BIT(from));
+        if (candidates)
+        {
+            u32int idx = s*32 + __builtin_ctz(candidates);
+            return idx < to ? idx : (u32int)-1;
+        }
+        from = (s + 1) * 32;
+    }
+    return (u32int)-1;
+}
+
+// Find a free block of the given order; there must be one.
+static u32int find_free(u32int order)
+{
+    u32int words = INDEX_FROM_BIT(nblocks[order] + 31);
+    u32int idx = first_free_word(order, hint[order], words);
+    if (idx == (u32int)-1)
+    {
+        idx = first_free_word(order, 0, hint[order]);
+    }
+    ASSERT(idx != (u32int)-1);
+    hint[order] = idx;
+    return idx*32 + __builtin_ctz(free_map[order][idx]);
+}
+
+void init_buddy(u32int nframes)
+{
+    u32int order;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+    {
+        u32int words = INDEX_FROM_BIT(nframes + 31);
+        u32int summary_words = INDEX_FROM_BIT(words + 31);
+        nblocks[order] = nframes;
+        free_map[order] = (u32int*)kmalloc(words * 4);
+        memset(free_map[order], 0, words * 4);
+        free_summary[order] = (u32int*)kmalloc(summary_words * 4);
+        memset(free_summary[order], 0, summary_words * 4);
+        free_blocks[order] = 0;
+        hint[order] = 0;
+        nframes >>= 1;
+    }
+}
+
+void buddy_release_range(u32int first, u32int count)
+{
+    while (count > 0)
+    {
+        // Hand over the biggest aligned block that fits.
+        u32int order = 0;
+        while (order < BUDDY_MAX_ORDER &&
+            (first & ((0x2 << order) - 1)) == 0 &&
+            (u32int)(0x2 << order) <= count)
+        {
+            order++;
+        }
+        free_frames(first, order);
+        first += 0x1 << order;
+        count -= 0x1 << order;
+    }
+}
+
+u32int alloc_frames(u32int order)
+{
+    ASSERT(order <= BUDDY_MAX_ORDER);
+
+    u32int current = order;
+    while (current <= BUDDY_MAX_ORDER && free_blocks[current] == 0)
+    {
+        current++;
+    }
+    if (current > BUDDY_MAX_ORDER)
+    {
+        return (u32int)-1;
+    }
+
+    u32int block = find_free(current);
+    mark_used(current, block);
+
+    // Split the block down to the requested size, freeing the upper half
+    // at every step.
+    while (current > order)
+    {
+        current--;
+        block <<= 1;
+        mark_free(current, block + 1);
+    }
+
+    return block << order;
+}
+
+void free_frames(u32int frame, u32int order)
+{
+    ASSERT(order <= BUDDY_MAX_ORDER);
+    u32int block = frame >> order;
+    ASSERT((block << order) == frame);
+    ASSERT(!is_free(order, block));
+
+    // Merge with the buddy for as long as it is free too.
+    while (order < BUDDY_MAX_ORDER && is_free(order, block ^ 1))
+    {
+        mark_used(order, block ^ 1);
+        block >>= 1;
+        order++;
+    }
+    mark_free(order, block);
+}
+
+u32int buddy_free_count()
+{
+    u32int order, count = 0;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+    {
+        count += free_blocks[order] << order;
+    }
+    return count;
+}
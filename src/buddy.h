@@ -0,0 +1,43 @@
+// buddy.h -- Binary buddy allocator for physical frames.
+
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include "common.h"
+
+/**
+   Largest block handed out, as a power of two of frames: order 10 is
+   1024 frames, or 4MB.
+**/
+#define BUDDY_MAX_ORDER 10
+
+/**
+   Sets up the allocator for nframes frames. Every frame starts out in
+   use; hand the free ones over with buddy_release_range().
+**/
+void init_buddy(u32int nframes);
+
+/**
+   Gives the frames [first, first + count) to the allocator.
+**/
+void buddy_release_range(u32int first, u32int count);
+
+/**
+   Allocate 2^order physically contiguous frames, aligned to their size.
+   Returns the number of the first frame, or (u32int)-1 if there is no
+   free block that big.
+**/
+u32int alloc_frames(u32int order);
+
+/**
+   Free the 2^order frames starting at frame, as returned by
+   alloc_frames(order).
+**/
+void free_frames(u32int frame, u32int order);
+
+/**
+   Returns the number of free frames.
+**/
+u32int buddy_free_count();
+
+#endif // BUDDY_H
@@ -23,19 +23,29 @@ u16int inw(u16int port)
     return ret;
 }
 
+u32int cpu_features()
+{
+    u32int eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    return edx;
+}
+
 // Copy len bytes from src to dest.
-void memcpy(u8int *dest, const u8int *src, u32int len)
+void memcpy(void *dest, const void *src, u32int len)
 {
     const u8int *sp = (const u8int *)src;
     u8int *dp = (u8int *)dest;
     for(; len != 0; len--) *dp++ = *sp++;
 }
 
-// Write len copies of val into dest.
-void memset(u8int *dest, u8int val, u32int len)
+// Write len copies of val into dest, a dword at a time.
+void memset(void *dest, u8int val, u32int len)
 {
-    u8int *temp = (u8int *)dest;
-    for ( ; len != 0; len--) *temp++ = val;
+    u32int words = len / 4;
+    u32int bytes = len % 4;
+    u32int fill = (u8int)val * 0x01010101u;
+    asm volatile("rep stosl" : "+D" (dest), "+c" (words) : "a" (fill) : "memory");
+    asm volatile("rep stosb" : "+D" (dest), "+c" (bytes) : "a" (fill) : "memory");
 }
 
 // Compare two strings. Should return -1 if 
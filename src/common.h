@@ -27,6 +27,15 @@ void outb(u16int port, u8int value);
 u8int inb(u16int port);
 u16int inw(u16int port);
 
+// Copy len bytes from src to dest.
+void memcpy(void *dest, const void *src, u32int len);
+
+// Write len copies of val into dest.
+void memset(void *dest, u8int val, u32int len);
+
+// The CPUID leaf 1 feature flags in EDX.
+u32int cpu_features();
+
 #define PANIC(msg) panic(msg, __FILE__, __LINE__);
 #define ASSERT(b) ((b) ? (void)0 : panic_assert(__FILE__, __LINE__, #b))
 
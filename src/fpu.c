@@ -0,0 +1,138 @@
+// fpu.c -- Lazy switching of the FPU/SSE registers.
+
+#include "fpu.h"
+#include "isr.h"
+#include "kheap.h"
+
+// CPUID leaf 1 feature bits, in EDX.
+#define CPUID_FXSR (1 << 24)
+#define CPUID_SSE (1 << 25)
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+extern volatile task_t *current_task;
+
+// The task whose registers are in the FPU, if any.
+static task_t *fpu_owner = NULL;
+
+// Whether fxsave/fxrstor can be used. Without them only the x87
+// registers exist, and fnsave/frstor handle those.
+static int fxsr = 0;
+
+// The registers right after initialisation; a task's first FPU
+// instruction starts from these rather than from another task's.
+static u8int initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+static void save(u8int *state) {
+  if (fxsr) {
+    asm volatile("fxsave (%0)" : : "r"(state) : "memory");
+  } else {
+    asm volatile("fnsave (%0)" : : "r"(state) : "memory");
+  }
+}
+
+static void restore(u8int *state) {
+  if (fxsr) {
+    asm volatile("fxrstor (%0)" : : "r"(state) : "memory");
+  } else {
+    asm volatile("frstor (%0)" : : "r"(state) : "memory");
+  }
+}
+
+static void set_ts(int on) {
+  u32int cr0;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  if (!!(cr0 & CR0_TS) == on) {
+    return;
+  }
+  asm volatile("mov %0, %%cr0" : : "r"(on ? cr0 | CR0_TS : cr0 & ~CR0_TS));
+}
+
+// Vector 7: a task used the FPU while CR0.TS was set, so its registers
+// aren't the ones loaded.
+static void device_not_available(registers_t *regs) {
+  task_t *task = (task_t*)current_task;
+
+  asm volatile("clts");
+  if (fpu_owner == task) {
+    return;
+  }
+  if (fpu_owner) {
+    save(fpu_owner->fpu_state);
+  }
+  restore(task->fpu_state);
+  fpu_owner = task;
+}
+
+void initialise_fpu() {
+  u32int features = cpu_features();
+
+  u32int cr0;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  cr0 = (cr0 | CR0_MP) & ~(CR0_EM | CR0_TS);
+  asm volatile("mov %0, %%cr0" : : "r"(cr0));
+
+  if (features & CPUID_FXSR) {
+    u32int cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR;
+    if (features & CPUID_SSE) {
+      cr4 |= CR4_OSXMMEXCPT;
+    }
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+    fxsr = 1;
+  }
+
+  asm volatile("fninit");
+  save(initial_state);
+
+  register_interrupt_handler(7, &device_not_available);
+  // Nobody owns the FPU yet.
+  set_ts(1);
+}
+
+void fpu_switch(task_t *next) {
+  set_ts(next != fpu_owner);
+}
+
+static u8int *alloc_state() {
+  return (u8int*)kmalloc_aligned(FPU_STATE_SIZE, FPU_STATE_ALIGN);
+}
+
+int fpu_init_task(task_t *task) {
+  task->fpu_state = alloc_state();
+  if (!task->fpu_state) {
+    return -1;
+  }
+  memcpy(task->fpu_state, initial_state, FPU_STATE_SIZE);
+  return 0;
+}
+
+int fpu_fork(task_t *parent, task_t *child) {
+  child->fpu_state = alloc_state();
+  if (!child->fpu_state) {
+    return -1;
+  }
+  if (fpu_owner == parent) {
+    // fnsave also resets the FPU, so rather than reload it, let the
+    // parent trap back in on its next FPU instruction.
+    asm volatile("clts");
+    save(parent->fpu_state);
+    fpu_owner = NULL;
+    set_ts(1);
+  }
+  memcpy(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE);
+  return 0;
+}
+
+void fpu_exit(task_t *task) {
+  if (fpu_owner == task) {
+    fpu_owner = NULL;
+  }
+  kfree((u32int)task->fpu_state);
+  task->fpu_state = NULL;
+}
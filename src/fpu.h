@@ -0,0 +1,44 @@
+// fpu.h -- Lazy switching of the FPU/SSE registers. A task's registers
+//          stay in the FPU until some other task uses it, so switching
+//          costs nothing for tasks that never touch floating point.
+
+#ifndef FPU_H
+#define FPU_H
+
+#include "common.h"
+#include "task.h"
+
+// Size and alignment fxsave needs for its save area.
+#define FPU_STATE_SIZE 512
+#define FPU_STATE_ALIGN 16
+
+/**
+   Enables the FPU, and SSE where the CPU has it, and installs the
+   device-not-available (#NM) handler.
+**/
+void initialise_fpu();
+
+/**
+   Called when next is about to run. Sets CR0.TS unless next's registers
+   are the ones in the FPU, so its first FPU instruction traps.
+**/
+void fpu_switch(task_t *next);
+
+/**
+   Gives a new task its save area, holding freshly initialised
+   registers. Returns 0, or -1 if there is no memory for it.
+**/
+int fpu_init_task(task_t *task);
+
+/**
+   Gives child a save area holding a copy of parent's registers.
+   Returns 0, or -1 if there is no memory for it.
+**/
+int fpu_fork(task_t *parent, task_t *child);
+
+/**
+   Frees the save area of a task that is exiting.
+**/
+void fpu_exit(task_t *task);
+
+#endif
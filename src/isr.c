@@ -21,7 +21,7 @@ void isr_handler(registers_t regs)
     if (interrupt_handlers[regs.int_no & 0xff] != 0)
     {
         isr_t handler = interrupt_handlers[regs.int_no & 0xff];
-        handler(regs);
+        handler(&regs);
     }
     else
     {
@@ -48,7 +48,7 @@ void irq_handler(registers_t regs)
     if (interrupt_handlers[regs.int_no] != 0)
     {
         isr_t handler = interrupt_handlers[regs.int_no];
-        handler(regs);
+        handler(&regs);
     }
 
 }
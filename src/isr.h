@@ -37,8 +37,9 @@ typedef struct registers
 
 // Enables registration of callbacks for interrupts or IRQs.
 // For IRQs, to ease confusion, use the #defines above as the
-// first parameter.
-typedef void (*isr_t)(registers_t);
+// first parameter. Handlers get the saved registers themselves, so
+// changes to them take effect when the interrupt returns.
+typedef void (*isr_t)(registers_t*);
 
 void register_interrupt_handler(u8int n, isr_t handler);
 
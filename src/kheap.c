@@ -5,6 +5,7 @@
 
 #include "kheap.h"
 #include "paging.h"
+#include "vmem.h"
 
 #include "monitor.h"
 
@@ -12,16 +13,22 @@
 extern uint32_t end;
 uint32_t placement_address = (uint32_t)&end;
 
-extern page_directory_t *kernel_directory;
-
 heap_t *kheap = NULL;
 
 uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys) {
   if (kheap != NULL) {
-    void *addr = alloc(sz, (u8int)align, kheap);
+    void *addr;
+    if (sz >= VMALLOC_THRESHOLD) {
+      addr = (void*)vmalloc(sz);
+    } else if (sz != 0 && (align == 1 || (sz & 0xFFF) == 0)) {
+      // Zero-sized requests get a minimal heap block instead, since a
+      // run of no pages can't be reserved.
+      addr = (void*)alloc_pages((sz + 0xFFF) / 0x1000);
+    } else {
+      addr = alloc(sz, (u8int)align, kheap);
+    }
     if (phys != 0) {
-      page_t *page = get_page((u32int)addr, 0, kernel_directory);
-      *phys = page->frame * 0x1000 + ((uint32_t)addr & 0xfff);
+      *phys = kernel_physical((u32int)addr);
     }
     return (uint32_t)addr;
   }
@@ -64,208 +71,428 @@ uint32_t kmalloc(uint32_t sz)
     return kmalloc_int(sz, 0, 0);
 }
 
-void kfree(uint32_t p) {
-  free((void*)p, kheap);
+uint32_t kmalloc_aligned(uint32_t sz, uint32_t align)
+{
+    ASSERT((align & (align - 1)) == 0);
+    if (align <= 4) {
+        return kmalloc(sz);
+    }
+
+    if (kheap == NULL) {
+        placement_address = (placement_address + align - 1) & ~(align - 1);
+        return kmalloc(sz);
+    }
+
+    if (align > 0x1000) {
+        uint32_t pages = sz ? (sz + 0xFFF) / 0x1000 : 1;
+        return alloc_pages_aligned(pages, align / 0x1000);
+    }
+    if (align == 0x1000 || sz >= VMALLOC_THRESHOLD) {
+        // Both of these hand out whole pages.
+        return kmalloc_align(sz);
+    }
+    return (uint32_t)alloc_aligned(sz, align, kheap);
 }
 
-static int32_t find_smallest_hole(uint32_t size, uint8_t page_align, heap_t *heap) {
-  uint32_t iterator = 0;
-  for (iterator; iterator < heap->index.size; iterator++) {
-    header_t *header = (header_t*)lookup_ordered_array(iterator, &heap->index);
-    if (page_align) {
-      uint32_t location = (uint32_t) header;
-      int32_t offset = 0;
-      if ((location + sizeof(header_t)) & 0xfffff000 != 0) {
-        offset = 0x1000 - (location + sizeof(header_t)) % 0x1000;
-      }
-      int32_t hole_size = header->size - offset;
-      if (hole_size >= size) {
-        break;
-      }
-    } else if (header->size >= size) {
-      break;
+uint32_t kcalloc(uint32_t n, uint32_t sz)
+{
+    uint32_t total = n * sz;
+    if (sz != 0 && total / sz != n) {
+        return 0;
     }
+
+    // vzalloc() zeroes each page as it maps it, so there is no need to
+    // go over the whole buffer a second time.
+    if (kheap != NULL && total >= VMALLOC_THRESHOLD) {
+        return vzalloc(total);
+    }
+
+    uint32_t p = kmalloc(total);
+    memset((u8int*)p, 0, total);
+    return p;
+}
+
+uint32_t krealloc(uint32_t p, uint32_t sz)
+{
+    if (p == 0) {
+        return kmalloc(sz);
+    }
+    if (sz == 0) {
+        kfree(p);
+        return 0;
+    }
+
+    uint32_t old_size;
+    if (is_page_run(p) || is_vmalloc(p)) {
+        old_size = vmem_size(p);
+        if (sz <= old_size) {
+            return p;
+        }
+    } else {
+        if (sz < VMALLOC_THRESHOLD) {
+            return (uint32_t)realloc((void*)p, sz, kheap);
+        }
+        header_t *header = (header_t*)(p - sizeof(header_t));
+        old_size = header->size - sizeof(header_t) - sizeof(footer_t);
+    }
+
+    uint32_t to = kmalloc(sz);
+    memcpy((u8int*)to, (u8int*)p, old_size < sz ? old_size : sz);
+    kfree(p);
+    return to;
+}
+
+void kfree(uint32_t p) {
+  if (is_page_run(p)) {
+    free_pages(p);
+  } else if (is_vmalloc(p)) {
+    vfree(p);
+  } else {
+    free((void*)p, kheap);
   }
+}
+
+#define HOLE_OVERHEAD (sizeof(header_t) + sizeof(footer_t))
+
+// Size class of a hole: floor(log2(size)).
+static uint32_t bin_of(uint32_t size) {
+  return 31 - __builtin_clz(size);
+}
 
-  if (iterator == heap->index.size) {
-    return -1;
+static void insert_hole(header_t *hole, heap_t *heap) {
+  uint32_t bin = bin_of(hole->size);
+  hole->prev_hole = NULL;
+  hole->next_hole = heap->bins[bin];
+  if (hole->next_hole) {
+    hole->next_hole->prev_hole = hole;
+  }
+  heap->bins[bin] = hole;
+  heap->bin_map |= 1 << bin;
+}
+
+// Unlink a hole from its bin. The back-pointer makes this constant time,
+// which matters when free() merges with a neighbouring hole.
+static void remove_hole(header_t *hole, heap_t *heap) {
+  uint32_t bin = bin_of(hole->size);
+  if (hole->prev_hole) {
+    hole->prev_hole->next_hole = hole->next_hole;
+  } else {
+    ASSERT(heap->bins[bin] == hole);
+    heap->bins[bin] = hole->next_hole;
+    if (heap->bins[bin] == NULL) {
+      heap->bin_map &= ~(1 << bin);
+    }
+  }
+  if (hole->next_hole) {
+    hole->next_hole->prev_hole = hole->prev_hole;
   }
+}
 
-  return iterator;
+// How far into a hole at 'location' a block has to start so that its
+// payload is aligned to 'align' bytes. Any gap left in front must be able
+// to hold a hole of its own.
+static uint32_t align_offset(uint32_t location, uint32_t align) {
+  uint32_t payload = location + sizeof(header_t);
+  if (align == 0 || (payload & (align - 1)) == 0) {
+    return 0;
+  }
+  uint32_t offset = align - (payload & (align - 1));
+  while (offset < HOLE_OVERHEAD) {
+    offset += align;
+  }
+  return offset;
 }
 
-static int8_t header_t_less_than(void *a, void *b) {
-  return ((header_t*)a)->size < ((header_t*)b)->size;
+static int8_t hole_fits(header_t *hole, uint32_t size, uint32_t align) {
+  return align_offset((uint32_t)hole, align) + size <= hole->size;
 }
 
-heap_t* create_heap(uint32_t start, uint32_t end_addr, uint32_t max,
-    uint8_t supervisor, uint8_t readonly) {
-  //heap_t *heap = (heap_t*)kmalloc(sizeof(heap_t));
-  static heap_t heap;
+static header_t *find_hole(uint32_t size, uint32_t align, heap_t *heap) {
+  // Any hole in a bin above the one holding 'want' bytes is big enough, so
+  // the first non-empty bin in the bitmap gives a fit in constant time.
+  uint32_t want = align ? size + align + HOLE_OVERHEAD : size;
+  uint32_t first_bin = bin_of(want - 1) + 1;
+  if (first_bin < HEAP_NBINS) {
+    uint32_t candidates = heap->bin_map & ~((1 << first_bin) - 1);
+    if (candidates) {
+      return heap->bins[__builtin_ctz(candidates)];
+    }
+  }
 
+  // Before growing the heap, look through the bins which may hold a
+  // suitable hole but don't guarantee one.
+  uint32_t bin;
+  for (bin = bin_of(size); bin < first_bin && bin < HEAP_NBINS; bin++) {
+    header_t *hole;
+    for (hole = heap->bins[bin]; hole; hole = hole->next_hole) {
+      if (hole_fits(hole, size, align)) {
+        return hole;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void write_footer(header_t *header) {
+  footer_t *footer = (footer_t*)((uint32_t)header + header->size -
+      sizeof(footer_t));
+  footer->magic = HEAP_MAGIC;
+  footer->header = header;
+}
 
+heap_t* create_heap(uint32_t start, uint32_t end_addr, uint32_t max,
+    uint8_t supervisor, uint8_t readonly, page_directory_t *dir) {
   // All our assumptions are made on startAddress and endAddress being page-aligned.
   ASSERT(start % 0x1000 == 0);
   ASSERT(end_addr % 0x1000 == 0);
 
-  heap.index = place_ordered_array((void*)start, HEAP_INDEX_SIZE, &header_t_less_than);
-
-  start += sizeof(type_t) * HEAP_INDEX_SIZE;
+  // Frames are only allocated as the pages get touched.
+  uint32_t i;
+  for (i = start; i < end_addr; i += 0x1000) {
+    reserve_page(get_page(i, 1, dir), supervisor, !readonly);
+  }
 
-  if (start & 0xFFFFF000 != 0) {
-    start &= 0xFFFFF000;
-    start += 0x1000;
+  heap_t *heap;
+  if (kheap != NULL) {
+    heap = (heap_t*)kmalloc(sizeof(heap_t));
+  } else {
+    // Nothing to allocate the kernel heap's own heap_t from yet, so it
+    // lives in front of the first block.
+    heap = (heap_t*)start;
+    start += (sizeof(heap_t) + 3) & ~3;
   }
-  heap.start_address = start;
-  heap.end_address = end_addr;
-  heap.max_address = max;
-  heap.supervisor = supervisor;
-  heap.readonly = readonly;
+
+  memset(heap, 0, sizeof(heap_t));
+  heap->start_address = start;
+  heap->end_address = end_addr;
+  heap->max_address = max;
+  heap->supervisor = supervisor;
+  heap->readonly = readonly;
+  heap->directory = dir;
+  heap->contract_threshold = HEAP_CONTRACT_THRESHOLD;
+  heap->contract_slack = HEAP_CONTRACT_SLACK;
 
   header_t *hole = (header_t*)start;
   hole->size = end_addr - start;
   hole->magic = HEAP_MAGIC;
   hole->is_hole = 1;
-  insert_ordered_array((void*)hole, &heap.index);
+  write_footer(hole);
+  insert_hole(hole, heap);
 
-  return &heap;
+  return heap;
+}
+
+void destroy_heap(heap_t *heap) {
+  uint32_t start = heap->start_address & 0xFFFFF000;
+  uint32_t end_addr = heap->end_address;
+  page_directory_t *dir = heap->directory;
+
+  if ((uint32_t)heap != start) {
+    kfree((uint32_t)heap);
+  }
+
+  uint32_t i;
+  for (i = start; i < end_addr; i += 0x1000) {
+    page_t *page = get_page(i, 0, dir);
+    if (page) {
+      free_frame(page);
+    }
+  }
+  flush_tlb_range(start, end_addr);
 }
 
 static void expand(u32int new_size, heap_t *heap) {
    ASSERT(new_size > heap->end_address - heap->start_address);
-   if (new_size & 0xFFFFF000 != 0) {
-       new_size &= 0xFFFFF000;
-       new_size += 0x1000;
-   }
+   // The heap always ends on a page boundary, even when it doesn't start
+   // on one.
+   new_size = ((heap->start_address + new_size + 0xFFF) & 0xFFFFF000) -
+       heap->start_address;
    ASSERT(heap->start_address + new_size <= heap->max_address);
 
    u32int old_size = heap->end_address-heap->start_address;
    u32int i = old_size;
    while (i < new_size)
    {
-       alloc_frame(get_page(heap->start_address + i, 1, kernel_directory),
-                    heap->supervisor, heap->readonly);
+       reserve_page(get_page(heap->start_address + i, 1, heap->directory),
+                    heap->supervisor, !heap->readonly);
        i += 0x1000 /* page size */;
    }
+   heap->bytes_expanded += new_size - old_size;
    heap->end_address = heap->start_address+new_size;
 }
 
+// Shrink the heap to (at least) new_size bytes, giving the frames behind
+// the tail back. Returns the new size, which is unchanged if rounding
+// leaves nothing to release.
 static u32int contract(u32int new_size, heap_t *heap) {
-   ASSERT(new_size < heap->end_address-heap->start_address);
-   if (new_size & 0x1000) {
-       new_size &= 0x1000;
-       new_size += 0x1000;
-   }
    if (new_size < HEAP_MIN_SIZE) {
        new_size = HEAP_MIN_SIZE;
    }
+   new_size = ((heap->start_address + new_size + 0xFFF) & 0xFFFFF000) -
+       heap->start_address;
    u32int old_size = heap->end_address - heap->start_address;
-   u32int i = old_size - 0x1000;
-   while (new_size < i) {
-       free_frame(get_page(heap->start_address + i, 0, kernel_directory));
-       i -= 0x1000;
+   if (new_size >= old_size) {
+       return old_size;
+   }
+   u32int i = new_size;
+   while (i < old_size) {
+       u32int address = heap->start_address + i;
+       free_frame(get_page(address, 0, heap->directory));
+       i += 0x1000;
    }
+   flush_tlb_range(heap->start_address + new_size,
+       heap->start_address + old_size);
+   heap->bytes_returned += old_size - new_size;
    heap->end_address = heap->start_address + new_size;
    return new_size;
 }
 
 void* alloc(uint32_t size, uint8_t page_align, heap_t *heap) {
-  uint32_t new_size = size + sizeof(header_t) + sizeof(footer_t);
-  int32_t iterator = find_smallest_hole(new_size, page_align, heap);
+  return alloc_aligned(size, page_align ? 0x1000 : 0, heap);
+}
+
+void* alloc_aligned(uint32_t size, uint32_t align, heap_t *heap) {
+  // Blocks are always word aligned, anything finer needs no special care.
+  if (align <= 4) {
+    align = 0;
+  }
+  ASSERT((align & (align - 1)) == 0);
 
-  if (iterator == -1) {
+  // Keep every header and footer word aligned.
+  size = (size + 3) & ~3;
+  uint32_t new_size = size + HOLE_OVERHEAD;
+  header_t *hole = find_hole(new_size, align, heap);
+
+  if (hole == NULL) {
     monitor_write("we expand here\n");
     uint32_t old_length = heap->end_address - heap->start_address;
     uint32_t old_end_address = heap->end_address;
+    uint32_t want = align ? new_size + align + HOLE_OVERHEAD : new_size;
 
-    expand(old_length + new_size, heap);
+    expand(old_length + want, heap);
     uint32_t new_length = heap->end_address - heap->start_address;
 
-    iterator = 0;
-    uint32_t idx = -1; uint32_t value = 0x0;
-    for (; iterator < heap->index.size; iterator++) {
-      uint32_t tmp = (uint32_t)lookup_ordered_array(iterator, &heap->index);
-      if (tmp > value) {
-        value = tmp;
-        idx = iterator;
-      }
-    }
-
-    if (idx == -1) {
-      header_t *header = (header_t *)old_end_address;
+    // The boundary tag just below the old end tells us whether the heap
+    // already ends in a hole we can simply extend.
+    footer_t *last_footer = (footer_t*)(old_end_address - sizeof(footer_t));
+    header_t *header;
+    if (last_footer->magic == HEAP_MAGIC && last_footer->header->is_hole) {
+      header = last_footer->header;
+      remove_hole(header, heap);
+      header->size += new_length - old_length;
+    } else {
+      header = (header_t *)old_end_address;
       header->magic = HEAP_MAGIC;
       header->size = new_length - old_length;
       header->is_hole = 1;
-      footer_t *footer = (footer_t *)(old_end_address + header->size -
-          sizeof(footer_t));
-      footer->magic = HEAP_MAGIC;
-      footer->header = header;
-      insert_ordered_array((void*)header, &heap->index);
-    } else {
-      header_t *header = lookup_ordered_array(idx, &heap->index);
-      header->size += new_length - old_length;
-      footer_t *footer = (footer_t *)((uint32_t)header + header->size -
-          sizeof(footer_t));
-      footer->header = header;
-      footer->magic = HEAP_MAGIC;
     }
+    write_footer(header);
+    insert_hole(header, heap);
     // We now have enough space. Recurse, and call the function again.
-    return alloc(size, page_align, heap);
+    return alloc_aligned(size, align, heap);
   }
 
-  header_t *orig_hole_header = (header_t*)lookup_ordered_array(iterator, &heap->index);
-  uint32_t orig_hole_pos = (uint32_t)orig_hole_header;
-  uint32_t orig_hole_size = orig_hole_header->size;
-  if (orig_hole_size - new_size < sizeof(header_t) + sizeof(footer_t)) {
-    size += orig_hole_size - new_size;
-    new_size = orig_hole_size;
+  remove_hole(hole, heap);
+  uint32_t orig_hole_pos = (uint32_t)hole;
+  uint32_t orig_hole_size = hole->size;
+
+  if (align) {
+    uint32_t offset = align_offset(orig_hole_pos, align);
+    if (offset) {
+      // Give the unaligned front of the hole back as a hole of its own.
+      header_t *hole_header = (header_t *)orig_hole_pos;
+      hole_header->size = offset;
+      hole_header->magic = HEAP_MAGIC;
+      hole_header->is_hole = 1;
+      write_footer(hole_header);
+      insert_hole(hole_header, heap);
+      orig_hole_pos += offset;
+      orig_hole_size -= offset;
+    }
   }
 
-  if (page_align && orig_hole_pos & 0xfffff000) {
-    u32int new_location   = orig_hole_pos + 0x1000 /* page size */ -
-      (orig_hole_pos & 0xfff) - sizeof(header_t);
-    header_t *hole_header = (header_t *)orig_hole_pos;
-    hole_header->size = 0x1000 /* page size */ - (orig_hole_pos & 0xfff)
-      - sizeof(header_t);
-    hole_header->magic  = HEAP_MAGIC;
-    hole_header->is_hole = 1;
-    footer_t *hole_footer = (footer_t *)((uint32_t)new_location -
-        sizeof(footer_t));
-    hole_footer->magic = HEAP_MAGIC;
-    hole_footer->header = hole_header;
-    orig_hole_pos = new_location;
-    orig_hole_size = orig_hole_size - hole_header->size;
-  } else {
-    remove_ordered_array(iterator, &heap->index);
+  if (orig_hole_size - new_size < HOLE_OVERHEAD) {
+    new_size = orig_hole_size;
   }
 
   header_t *block_header = (header_t*)orig_hole_pos;
   block_header->magic = HEAP_MAGIC;
   block_header->is_hole = 0;
   block_header->size = new_size;
+  write_footer(block_header);
 
-  footer_t *block_footer = (footer_t*)(orig_hole_pos + sizeof(header_t) + size);
-  block_footer->magic = HEAP_MAGIC;
-  block_footer->header = block_header;
-
-  if (orig_hole_size - new_size > 0) {
-    header_t *hole_header = (header_t *)(orig_hole_pos + sizeof(header_t) +
-        size + sizeof(footer_t));
+  if (orig_hole_size > new_size) {
+    header_t *hole_header = (header_t *)(orig_hole_pos + new_size);
     hole_header->magic = HEAP_MAGIC;
     hole_header->is_hole = 1;
     hole_header->size = orig_hole_size - new_size;
-    footer_t *hole_footer = (footer_t *)((uint32_t)hole_header +
-        orig_hole_size - new_size - sizeof(footer_t));
+    write_footer(hole_header);
+    insert_hole(hole_header, heap);
+  }
+
+  return (void*)((uint32_t)block_header + sizeof(header_t));
+}
+
+// Turn the part of block past new_size bytes into a hole, merging it with
+// the hole that follows, if any. What is cut off must be able to hold a
+// hole of its own.
+static void split_block(header_t *block, uint32_t new_size, heap_t *heap) {
+  header_t *tail = (header_t*)((uint32_t)block + new_size);
+  tail->magic = HEAP_MAGIC;
+  tail->is_hole = 1;
+  tail->size = block->size - new_size;
+  block->size = new_size;
+  write_footer(block);
+
+  header_t *next = (header_t*)((uint32_t)tail + tail->size);
+  if ((uint32_t)next < heap->end_address &&
+      next->magic == HEAP_MAGIC &&
+      next->is_hole) {
+    remove_hole(next, heap);
+    tail->size += next->size;
+  }
+  write_footer(tail);
+  insert_hole(tail, heap);
+}
 
-    if ((uint32_t)hole_footer < heap->end_address) {
-      hole_footer->magic = HEAP_MAGIC;
-      hole_footer->header = hole_header;
+void *realloc(void *p, uint32_t size, heap_t *heap) {
+  if (p == NULL) {
+    return alloc(size, 0, heap);
+  }
+
+  header_t *header = (header_t*)((uint32_t)p - sizeof(header_t));
+  ASSERT(header->magic == HEAP_MAGIC);
+  ASSERT(!header->is_hole);
+
+  size = (size + 3) & ~3;
+  uint32_t new_size = size + HOLE_OVERHEAD;
+
+  if (new_size > header->size) {
+    // The boundary tags tell us whether the block is followed by a hole
+    // big enough to grow into.
+    header_t *next = (header_t*)((uint32_t)header + header->size);
+    if ((uint32_t)next < heap->end_address &&
+        next->magic == HEAP_MAGIC &&
+        next->is_hole &&
+        header->size + next->size >= new_size) {
+      remove_hole(next, heap);
+      header->size += next->size;
+      write_footer(header);
     }
+  }
 
-    insert_ordered_array((void*)hole_header, &heap->index);
+  if (new_size <= header->size) {
+    if (header->size - new_size >= HOLE_OVERHEAD) {
+      split_block(header, new_size, heap);
+    }
+    return p;
   }
 
-  return (void*)((uint32_t)block_header + sizeof(header_t));
+  void *to = alloc(size, 0, heap);
+  memcpy(to, p, header->size - HOLE_OVERHEAD);
+  free(p, heap);
+  return to;
 }
 
 void free(void *p, heap_t *heap) {
@@ -281,38 +508,34 @@ void free(void *p, heap_t *heap) {
   ASSERT(footer->magic == HEAP_MAGIC);
 
   header->is_hole = 1;
-  int8_t do_add = 1;
 
   footer_t *test_footer = (footer_t*)((uint32_t)header - sizeof(footer_t));
-  if (test_footer->magic == HEAP_MAGIC &&
+  if ((uint32_t)header > heap->start_address &&
+      test_footer->magic == HEAP_MAGIC &&
       test_footer->header->is_hole == 1) {
     uint32_t cache_size = header->size;
     header = test_footer->header;
-    footer->header = header;
+    remove_hole(header, heap);
     header->size += cache_size;
-    do_add = 0;
   }
 
   header_t *test_header = (header_t*)((uint32_t)footer + sizeof(footer_t));
-  if (test_header->magic == HEAP_MAGIC &&
+  if ((uint32_t)test_header < heap->end_address &&
+      test_header->magic == HEAP_MAGIC &&
       test_header->is_hole) {
+    remove_hole(test_header, heap);
     header->size += test_header->size;
-    test_footer = (footer_t*)((uint32_t)test_header +
-        test_header->size - sizeof(footer_t));
-    footer = test_footer;
-    uint32_t iterator = 0;
-    for (; (iterator < heap->index.size) &&
-        (lookup_ordered_array(iterator, &heap->index) != (void*)test_header);
-        iterator++);
-
-    ASSERT(iterator < heap->index.size);
-    remove_ordered_array(iterator, &heap->index);
   }
 
-  // don't do contracting
-
-  if (do_add == 1) {
-      insert_ordered_array((void*)header, &heap->index);
+  // If this left a big enough hole at the end of the heap, hand all but
+  // contract_slack bytes of it back to the frame allocator.
+  if ((uint32_t)header + header->size == heap->end_address &&
+      header->size > heap->contract_threshold) {
+    contract((uint32_t)header - heap->start_address + heap->contract_slack,
+        heap);
+    header->size = heap->end_address - (uint32_t)header;
   }
-}
 
+  write_footer(header);
+  insert_hole(header, heap);
+}
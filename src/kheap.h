@@ -7,18 +7,37 @@
 #define KHEAP_H
 
 #include "common.h"
-#include "ordered_array.h"
+#include "paging.h"
 
 #define KHEAP_START         0xC0000000
 #define KHEAP_INITIAL_SIZE  0x100000
-#define HEAP_INDEX_SIZE   0x20000
+#define KHEAP_MAX           0xCFFFF000
 #define HEAP_MAGIC        0x123890AB
 #define HEAP_MIN_SIZE     0x70000
 
-typedef struct {
+/**
+   Default contraction policy: once the hole at the end of a heap is
+   bigger than HEAP_CONTRACT_THRESHOLD, the heap is shrunk so that only
+   HEAP_CONTRACT_SLACK bytes of that hole stay mapped. The gap between
+   the two keeps a heap hovering around one size from bouncing between
+   expand() and contract().
+**/
+#define HEAP_CONTRACT_THRESHOLD 0x80000
+#define HEAP_CONTRACT_SLACK     0x20000
+
+/**
+   Number of size-class bins. Bin i holds every hole whose size
+   is in [2^i, 2^(i+1)), so 32 bins cover the whole address space.
+**/
+#define HEAP_NBINS        32
+
+typedef struct header {
   uint32_t magic;
   uint8_t is_hole;
   uint32_t size;
+  // Neighbours in the same bin. Only meaningful while is_hole == 1.
+  struct header *next_hole;
+  struct header *prev_hole;
 } header_t;
 
 typedef struct {
@@ -27,21 +46,68 @@ typedef struct {
 } footer_t;
 
 typedef struct {
-  ordered_array_t index;
+  /**
+     Segregated free lists, one per power-of-two size class, and
+     a bitmap with bit i set whenever bins[i] is non-empty.
+  **/
+  header_t *bins[HEAP_NBINS];
+  uint32_t bin_map;
+
   uint32_t start_address;
   uint32_t end_address;
   uint32_t max_address;
 
   uint8_t supervisor;
   uint8_t readonly;
+
+  // Address space the heap's pages are mapped into.
+  page_directory_t *directory;
+
+  // Contraction policy, see HEAP_CONTRACT_THRESHOLD. Tunable per heap.
+  uint32_t contract_threshold;
+  uint32_t contract_slack;
+
+  // Statistics.
+  uint32_t bytes_expanded;
+  uint32_t bytes_returned;
 } heap_t;
 
 
+/**
+   Create a heap over [start, end), able to grow up to max, and map its
+   initial pages into dir. Any number of heaps can exist at once, e.g. a
+   user-mode heap (supervisor == 0) in a task's address space next to
+   the kernel heap.
+
+   Once the kernel heap is up the heap_t itself comes from it; before
+   that it is placed at the start of the new heap's own range.
+
+   A heap may only be used while its range is mapped in the current
+   address space.
+**/
 heap_t *create_heap(uint32_t start, uint32_t end, uint32_t max,
-    uint8_t supervisor, uint8_t readonly);
+    uint8_t supervisor, uint8_t readonly, page_directory_t *dir);
+
+/**
+   Unmap every page of heap and release the heap_t.
+**/
+void destroy_heap(heap_t *heap);
 
 void *alloc(uint32_t size, uint8_t page_align, heap_t *heap);
 
+/**
+   Allocate size bytes from heap with the payload aligned to align bytes,
+   which must be a power of two.
+**/
+void *alloc_aligned(uint32_t size, uint32_t align, heap_t *heap);
+
+/**
+   Resize the block at p to size bytes. Shrinking splits the block in
+   place, and growing first tries to take over the hole right after it;
+   only if that hole is missing or too small is the block moved.
+**/
+void *realloc(void *p, uint32_t size, heap_t *heap);
+
 void free(void *p, heap_t *heap);
 
 /**
@@ -58,6 +124,10 @@ uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys);
 /**
    Allocate a chunk of memory, sz in size. The chunk must be
    page aligned.
+
+   Once the heap is up, page-aligned requests and requests for a whole
+   number of pages are served by alloc_pages() rather than the heap,
+   and anything of VMALLOC_THRESHOLD bytes or more by vmalloc().
 **/
 uint32_t kmalloc_align(uint32_t sz);
 
@@ -78,5 +148,24 @@ uint32_t kmalloc_ap(uint32_t sz, uint32_t *phys);
 **/
 uint32_t kmalloc(uint32_t sz);
 
+/**
+   Allocate a chunk of memory, sz in size, aligned to align bytes. Align
+   must be a power of two and may be larger than a page.
+**/
+uint32_t kmalloc_aligned(uint32_t sz, uint32_t align);
+
+/**
+   Allocate n zeroed elements of sz bytes each. Returns 0 if n * sz
+   overflows.
+**/
+uint32_t kcalloc(uint32_t n, uint32_t sz);
+
+/**
+   Resize the chunk at p to sz bytes, in place where possible, and
+   return its (possibly new) address. Behaves like kmalloc if p is 0 and
+   like kfree if sz is 0.
+**/
+uint32_t krealloc(uint32_t p, uint32_t sz);
+
 void kfree(uint32_t p);
 #endif // KHEAP_H
@@ -8,6 +8,8 @@
 #include "kheap.h"
 #include "task.h"
 #include "syscall.h"
+#include "multiboot.h"
+#include "bench.h"
 
 uint32_t initial_esp;
 
@@ -27,9 +29,22 @@ int caca(int a) {
   return x;
 }
 
+// Runs when nothing else needs the CPU, doing work that can be done
+// ahead of time and halting once there is none left.
+void idle() {
+  set_priority(IDLE_PRIORITY);
+  for (;;) {
+    refill_zero_pool();
+    idle_wait();
+  }
+}
+
 int kernel_main(void *ptr, uint32_t initial_stack) {
   initial_esp = initial_stack;
 
+  // Read the memory map before anything gets allocated.
+  multiboot_init(ptr);
+
   // Initialise all the ISRs and segmentation
   init_descriptor_tables();
   // Initialise the screen (by clearing it)
@@ -43,6 +58,16 @@ int kernel_main(void *ptr, uint32_t initial_stack) {
   monitor_write_hex(initial_esp);
   initialise_tasking();
 
+  // The idle task has to stay in ring 0, so start it before we drop to
+  // user mode.
+  if (fork() == 0) {
+    idle();
+  }
+
+#ifdef BENCHMARK
+  run_benchmarks();
+#endif
+
   //monitor_write("\nha\n");
   /*int ret = fork();
 
@@ -55,15 +80,15 @@ int kernel_main(void *ptr, uint32_t initial_stack) {
 
   initialise_syscalls();
 
-  switch_to_user_mode();
+  // No ring 3 here: the kernel image is mapped supervisor only, so
+  // there is no user code to drop into.
+  //switch_to_user_mode();
 
   //monitor_write("daaa");
   //syscall_monitor_write("ce mai faci?");
-  
-  void *x = kmalloc(0x500000);
-  monitor_write("da");
 
-  for (;;);
+  // Leave the CPU to the idle task rather than spinning on it.
+  exit_task();
 
   return 0;
 }
@@ -0,0 +1,201 @@
+// multiboot.c -- Reads the boot information a Multiboot2 loader leaves us.
+//
+// Everything we need is copied out of the info block here, before the
+// first allocation. The block's frames are still never reported as
+// usable, so nothing handed out later can overlap it. Modules stay where
+// the loader put them: the placement allocator is moved past them and
+// their frames are cut out as well.
+
+#include "multiboot.h"
+
+// Defined in kheap.c
+extern u32int placement_address;
+
+// Assumed when the loader gives us no memory information at all.
+#define DEFAULT_MEM_END 0x1000000
+
+#define MAX_MODULES 16
+
+typedef struct
+{
+    u32int first;
+    u32int last;
+} frame_range_t;
+
+static frame_range_t regions[MULTIBOOT_MAX_REGIONS];
+static u32int nregions = 0;
+
+static frame_range_t modules[MAX_MODULES];
+static u32int nmodules = 0;
+
+// Frames holding the info block itself.
+static frame_range_t info_frames;
+
+// Make sure the placement allocator doesn't hand out anything below end.
+static void reserve_below(u32int end)
+{
+    if (end > placement_address)
+    {
+        placement_address = end;
+    }
+}
+
+static void add_region(unsigned long long start, unsigned long long end)
+{
+    // We can only address the first 4GB.
+    if (end > 0x100000000ULL)
+    {
+        end = 0x100000000ULL;
+    }
+    u32int first = (u32int)((start + 0xFFF) >> 12);
+    u32int last = (u32int)(end >> 12);
+    if (first >= last || nregions == MULTIBOOT_MAX_REGIONS)
+    {
+        return;
+    }
+    regions[nregions].first = first;
+    regions[nregions].last = last;
+    nregions++;
+}
+
+// Cut the frames of r out of every region, splitting regions as needed.
+static void remove_range(frame_range_t *r)
+{
+    u32int i;
+    for (i = 0; i < nregions; i++)
+    {
+        frame_range_t *region = &regions[i];
+        if (r->last <= region->first || r->first >= region->last)
+        {
+            continue;
+        }
+        if (r->first > region->first && r->last < region->last)
+        {
+            // The range is in the middle; keep the upper part separately.
+            if (nregions < MULTIBOOT_MAX_REGIONS)
+            {
+                regions[nregions].first = r->last;
+                regions[nregions].last = region->last;
+                nregions++;
+            }
+            region->last = r->first;
+        }
+        else if (r->first > region->first)
+        {
+            region->last = r->first;
+        }
+        else if (r->last < region->last)
+        {
+            region->first = r->last;
+        }
+        else
+        {
+            region->first = region->last;
+        }
+    }
+}
+
+void multiboot_init(void *mbi)
+{
+    multiboot_tag_meminfo_t *meminfo = NULL;
+    int have_mmap = 0;
+
+    if (mbi != NULL)
+    {
+        multiboot_info_t *info = (multiboot_info_t*)mbi;
+        u32int tag_addr = (u32int)mbi + sizeof(multiboot_info_t);
+        u32int info_end = (u32int)mbi + info->total_size;
+
+        while (tag_addr < info_end)
+        {
+            multiboot_tag_t *tag = (multiboot_tag_t*)tag_addr;
+            if (tag->type == MULTIBOOT_TAG_END)
+            {
+                break;
+            }
+
+            if (tag->type == MULTIBOOT_TAG_MMAP)
+            {
+                multiboot_tag_mmap_t *mmap = (multiboot_tag_mmap_t*)tag;
+                u32int entry = (u32int)mmap->entries;
+                for (; entry < tag_addr + tag->size; entry += mmap->entry_size)
+                {
+                    multiboot_mmap_entry_t *e = (multiboot_mmap_entry_t*)entry;
+                    if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+                    {
+                        add_region(e->addr, e->addr + e->len);
+                    }
+                }
+                have_mmap = 1;
+            }
+            else if (tag->type == MULTIBOOT_TAG_MEMINFO)
+            {
+                meminfo = (multiboot_tag_meminfo_t*)tag;
+            }
+            else if (tag->type == MULTIBOOT_TAG_MODULE && nmodules < MAX_MODULES)
+            {
+                multiboot_tag_module_t *module = (multiboot_tag_module_t*)tag;
+                modules[nmodules].first = module->mod_start >> 12;
+                modules[nmodules].last = (module->mod_end + 0xFFF) >> 12;
+                nmodules++;
+                reserve_below(module->mod_end);
+            }
+
+            // Tags are padded to 8 bytes.
+            tag_addr += (tag->size + 7) & ~7;
+        }
+
+        // Raising the placement address past the block would identity
+        // map, and lose, all memory below it if the loader put it high.
+        info_frames.first = (u32int)mbi >> 12;
+        info_frames.last = (info_end + 0xFFF) >> 12;
+    }
+
+    if (!have_mmap)
+    {
+        if (meminfo != NULL)
+        {
+            add_region(0, meminfo->mem_lower * 1024ULL);
+            add_region(0x100000, 0x100000 + meminfo->mem_upper * 1024ULL);
+        }
+        else
+        {
+            add_region(0x100000, DEFAULT_MEM_END);
+        }
+    }
+
+    u32int i;
+    for (i = 0; i < nmodules; i++)
+    {
+        remove_range(&modules[i]);
+    }
+    if (mbi != NULL)
+    {
+        remove_range(&info_frames);
+    }
+}
+
+u32int multiboot_end_frame()
+{
+    u32int i, end_frame = 0;
+    for (i = 0; i < nregions; i++)
+    {
+        if (regions[i].last > end_frame)
+        {
+            end_frame = regions[i].last;
+        }
+    }
+    return end_frame;
+}
+
+u32int multiboot_region_count()
+{
+    return nregions;
+}
+
+void multiboot_region(u32int i, u32int *first, u32int *last)
+{
+    ASSERT(i < nregions);
+    *first = regions[i].first;
+    *last = regions[i].last;
+}
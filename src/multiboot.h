@@ -0,0 +1,85 @@
+// multiboot.h -- Reads the boot information a Multiboot2 loader leaves us:
+//                the memory map, modules and the info block itself.
+
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include "common.h"
+
+#define MULTIBOOT_TAG_END       0
+#define MULTIBOOT_TAG_MODULE    3
+#define MULTIBOOT_TAG_MEMINFO   4
+#define MULTIBOOT_TAG_MMAP      6
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// Most usable regions we keep track of.
+#define MULTIBOOT_MAX_REGIONS   32
+
+typedef struct
+{
+    u32int total_size;
+    u32int reserved;
+} multiboot_info_t;
+
+typedef struct
+{
+    u32int type;
+    u32int size;
+} multiboot_tag_t;
+
+typedef struct
+{
+    u32int type;
+    u32int size;
+    u32int mod_start;
+    u32int mod_end;
+    char cmdline[0];
+} multiboot_tag_module_t;
+
+typedef struct
+{
+    u32int type;
+    u32int size;
+    u32int mem_lower;           // KB below 1MB.
+    u32int mem_upper;           // KB above 1MB, up to the first hole.
+} multiboot_tag_meminfo_t;
+
+typedef struct
+{
+    unsigned long long addr;
+    unsigned long long len;
+    u32int type;
+    u32int zero;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+typedef struct
+{
+    u32int type;
+    u32int size;
+    u32int entry_size;
+    u32int entry_version;
+    multiboot_mmap_entry_t entries[0];
+} multiboot_tag_mmap_t;
+
+/**
+   Parses the boot information at mbi, copying out what is needed. Must
+   run before anything is allocated, since it also moves the placement
+   address past any modules so they don't get overwritten.
+**/
+void multiboot_init(void *mbi);
+
+/**
+   End of usable physical memory, clipped to 4GB and rounded down to a
+   frame, as a frame number.
+**/
+u32int multiboot_end_frame();
+
+/**
+   Number of usable RAM regions, and the i-th of them as the frame range
+   [first, last). Modules and the info block are already cut out.
+**/
+u32int multiboot_region_count();
+void multiboot_region(u32int i, u32int *first, u32int *last);
+
+#endif // MULTIBOOT_H
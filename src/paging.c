@@ -3,6 +3,12 @@
 
 #include "paging.h"
 #include "kheap.h"
+#include "slab.h"
+#include "vmem.h"
+#include "buddy.h"
+#include "multiboot.h"
+#include "task.h"
+#include "vma.h"
 
 // The kernel's page directory
 page_directory_t *kernel_directory=0;
@@ -10,128 +16,361 @@ page_directory_t *kernel_directory=0;
 // The current page directory;
 page_directory_t *current_directory=0;
 
-// A bitset of frames - used or free.
-u32int *frames;
+// Object cache for page directories, set up once the kernel heap exists.
+// Page tables are bare frames, reached through the self-map.
+static kmem_cache_t *directory_cache = NULL;
+
+// Set once CR4.PGE is on and kernel pages stay in the TLB across CR3
+// loads.
+static int global_pages = 0;
+
+// Until paging is on, table addresses in a directory are used as they
+// are; the boot allocations are identity mapped.
+static int paging_enabled = 0;
+
+// Number of physical frames. The frames themselves are handed out by
+// the buddy allocator.
 u32int nframes;
 
+// How many page table entries map each frame. Only frames from the
+// buddy allocator are counted; a count of zero means the frame belongs
+// to the identity-mapped kernel image and is never freed.
+static u16int *frame_refs;
+
 // Defined in kheap.c
 extern u32int placement_address;
 extern heap_t *kheap;
 
-// Macros used in the bitset algorithms.
-#define INDEX_FROM_BIT(a) (a/(8*4))
-#define OFFSET_FROM_BIT(a) (a%(8*4))
 
-// Static function to set a bit in the frames bitset
-static void set_frame(u32int frame_addr)
-{
-    u32int frame = frame_addr/0x1000;
-    u32int idx = INDEX_FROM_BIT(frame);
-    u32int off = OFFSET_FROM_BIT(frame);
-    frames[idx] |= (0x1 << off);
+// CPUID leaf 1 feature bits, in EDX.
+#define CPUID_PSE (1 << 3)
+#define CPUID_PGE (1 << 13)
+
+// Ranges longer than this many pages are flushed all at once.
+#define FLUSH_RANGE_PAGES 32
+
+// Non-zero if address is mapped by one of the kernel's tables, which
+// every directory shares.
+static int is_kernel_table(u32int address) {
+    u32int table_idx = address / 0x400000;
+    u32int table = kernel_directory->tablesPhysical[table_idx] & 0xFFFFF000;
+    return table != 0 &&
+        table == (current_directory->tablesPhysical[table_idx] & 0xFFFFF000);
 }
 
-// Static function to clear a bit in the frames bitset
-static void clear_frame(u32int frame_addr)
-{
-    u32int frame = frame_addr/0x1000;
-    u32int idx = INDEX_FROM_BIT(frame);
-    u32int off = OFFSET_FROM_BIT(frame);
-    frames[idx] &= ~(0x1 << off);
+void flush_tlb_page(u32int address) {
+    asm volatile("invlpg (%0)" : : "r"(address) : "memory");
 }
 
-// Static function to test if a bit is set.
-static u32int test_frame(u32int frame_addr)
-{
-    u32int frame = frame_addr/0x1000;
-    u32int idx = INDEX_FROM_BIT(frame);
-    u32int off = OFFSET_FROM_BIT(frame);
-    return (frames[idx] & (0x1 << off));
+void flush_tlb_range(u32int start, u32int end) {
+    start &= 0xFFFFF000;
+    if ((end - start) / 0x1000 <= FLUSH_RANGE_PAGES) {
+        for (; start < end; start += 0x1000) {
+            flush_tlb_page(start);
+        }
+        return;
+    }
+    // Reloading CR3 drops every entry that isn't global. Kernel pages
+    // are global, so for them turn PGE off and on again.
+    if (global_pages && is_kernel_table(start)) {
+        u32int cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 & ~0x80) : "memory");
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    } else {
+        u32int cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
 }
 
-// Static function to find the first free frame.
-static u32int first_frame()
-{
-    u32int i, j;
-    for (i = 0; i < INDEX_FROM_BIT(nframes); i++)
-    {
-        if (frames[i] != 0xFFFFFFFF) // nothing free, exit early.
-        {
-            // at least one bit is free here.
-            for (j = 0; j < 32; j++)
-            {
-                u32int toTest = 0x1 << j;
-                if ( !(frames[i]&toTest) )
-                {
-                    return i*4*8+j;
-                }
-            }
+// Interrupts are turned off while the frame window or the zero pool is
+// used, since page faults use both.
+static u32int disable_interrupts() {
+    u32int eflags;
+    asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+    return eflags;
+}
+
+static void restore_interrupts(u32int eflags) {
+    asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+// Point slot of the frame window at frame and return its address.
+// Interrupts must be off while the window is in use.
+static void *map_window(u32int slot, u32int frame) {
+    u32int address = FRAME_WINDOW_START + slot * 0x1000;
+    page_t *page = get_page(address, 0, kernel_directory);
+    page->present = 1;
+    page->rw = 1;
+    page->user = 0;
+    page->global = 1;
+    page->frame = frame;
+    flush_tlb_page(address);
+    return (void*)address;
+}
+
+void copy_page_physical(u32int src, u32int dst) {
+    u32int eflags = disable_interrupts();
+
+    void *from = map_window(0, src / 0x1000);
+    void *to = map_window(1, dst / 0x1000);
+    u32int count = 1024;
+    asm volatile("rep movsl"
+        : "+S"(from), "+D"(to), "+c"(count) : : "memory");
+
+    restore_interrupts(eflags);
+}
+
+// Clear a frame that need not be mapped anywhere.
+static void zero_frame(u32int frame) {
+    u32int eflags = disable_interrupts();
+
+    void *to = map_window(0, frame);
+    u32int count = 1024;
+    asm volatile("rep stosl"
+        : "+D"(to), "+c"(count) : "a"(0) : "memory");
+
+    restore_interrupts(eflags);
+}
+
+// Frames that are already zero, ready to be handed out.
+#define ZERO_POOL_SIZE 64
+static u32int zero_pool[ZERO_POOL_SIZE];
+static u32int zero_pool_count = 0;
+static u32int zero_pool_hits = 0;
+static u32int zero_pool_misses = 0;
+
+// The pool is only refilled while the buddy allocator has more free
+// frames than this, so it never soaks up the last of memory.
+#define ZERO_POOL_RESERVE 256
+
+// Takes a frame for any use. When the buddy allocator has run out, the
+// frames waiting in the zero pool are as good as any.
+static u32int take_frame() {
+    u32int frame = alloc_frames(0);
+    if (frame != (u32int)-1) {
+        return frame;
+    }
+    u32int eflags = disable_interrupts();
+    if (zero_pool_count > 0) {
+        frame = zero_pool[--zero_pool_count];
+    }
+    restore_interrupts(eflags);
+    if (frame == (u32int)-1) {
+        PANIC("No free frames!");
+    }
+    return frame;
+}
+
+// Returns a frame that reads as zero, from the pool if possible.
+static u32int zeroed_frame() {
+    u32int eflags = disable_interrupts();
+    if (zero_pool_count > 0) {
+        u32int frame = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+        restore_interrupts(eflags);
+        return frame;
+    }
+    zero_pool_misses++;
+    restore_interrupts(eflags);
+
+    u32int frame = take_frame();
+    zero_frame(frame);
+    return frame;
+}
+
+void refill_zero_pool() {
+    for (;;) {
+        // One frame at a time, so interrupts are never off for long.
+        u32int eflags = disable_interrupts();
+        if (zero_pool_count == ZERO_POOL_SIZE) {
+            restore_interrupts(eflags);
+            return;
         }
+        // Leave what's left to the allocations that really need it.
+        if (buddy_free_count() <= ZERO_POOL_RESERVE) {
+            restore_interrupts(eflags);
+            return;
+        }
+        u32int frame = alloc_frames(0);
+        zero_frame(frame);
+        zero_pool[zero_pool_count++] = frame;
+        restore_interrupts(eflags);
     }
 }
 
+void zero_pool_dump_stats() {
+    monitor_write("zero pool: ");
+    monitor_write_dec(zero_pool_count);
+    monitor_write("/");
+    monitor_write_dec(ZERO_POOL_SIZE);
+    monitor_write(" hits ");
+    monitor_write_dec(zero_pool_hits);
+    monitor_write(" misses ");
+    monitor_write_dec(zero_pool_misses);
+    monitor_write("\n");
+}
+
+// Point page at frame idx, which has just been allocated.
+static void map_frame(page_t *page, u32int idx, int is_kernel,
+                      int is_writeable) {
+    page->present = 1;
+    page->rw = is_writeable ? 1 : 0;
+    page->user = !is_kernel;
+    page->frame = idx;
+    frame_refs[idx] = 1;
+}
+
 // Function to allocate a frame.
 void alloc_frame(page_t *page, int is_kernel, int is_writeable) {
     if (page->frame != 0) {
         return;
     }
-    u32int idx = first_frame();
-    if (idx == (u32int)-1) {
-      // PANIC! no free frames!!
+    map_frame(page, take_frame(), is_kernel, is_writeable);
+}
+
+void reserve_page(page_t *page, int is_kernel, int is_writeable) {
+    if (page->frame != 0) {
+        return;
     }
-    set_frame(idx * 0x1000);
-    page->present = 1;
-    page->rw = 1;//is_writeable;
+    page->present = 0;
+    page->rw = is_writeable ? 1 : 0;
     page->user = !is_kernel;
-    page->frame = idx;
+    page->lazy = 1;
+}
+
+// Backs a reserved page with a zeroed frame. address must be mapped
+// through page in the current directory.
+static void fault_in(page_t *page, u32int address) {
+    page->lazy = 0;
+    // Keep the access the page was reserved with.
+    map_frame(page, zeroed_frame(), !page->user, page->rw);
+    page->global = is_kernel_table(address);
+}
+
+u32int kernel_physical(u32int address) {
+    u32int pde = kernel_directory->tablesPhysical[address / 0x400000];
+    if (pde & PAGE_DIR_LARGE) {
+        return (pde & 0xFFC00000) + (address & 0x3FFFFF);
+    }
+    page_t *page = get_page(address, 0, kernel_directory);
+    if (page->lazy) {
+        fault_in(page, address);
+    }
+    return page->frame * 0x1000 + (address & 0xFFF);
+}
+
+u32int alloc_shared_frame() {
+    u32int frame = zeroed_frame();
+    frame_refs[frame] = 1;
+    return frame;
+}
+
+void map_shared_frame(page_t *page, u32int frame) {
+    page->present = 1;
+    page->rw = 1;
+    page->user = 1;
+    page->shared = 1;
+    page->frame = frame;
+    frame_refs[frame]++;
+}
+
+void put_frame(u32int frame) {
+    if (frame_refs[frame] && --frame_refs[frame] == 0) {
+        free_frames(frame, 0);
+    }
 }
 
 // Function to deallocate a frame.
 void free_frame(page_t *page)
 {
     u32int frame;
+    page->lazy = 0;
     if (!(frame=page->frame))
     {
         return;
     }
     else
     {
-        clear_frame(frame);
+        // Other page tables may still map the frame after a fork.
+        put_frame(frame);
         page->frame = 0x0;
+        page->present = 0;
+        page->cow = 0;
+        page->shared = 0;
     }
 }
 
 extern u32int end;
 
 void initialise_paging() {
-  // The size of physical memory. For the moment we 
-  // assume it is 16MB big.
-  u32int mem_end_page = 0x1000000;
+  u32int i;
 
-  nframes = mem_end_page / 0x1000;
-  frames = (u32int*)kmalloc(INDEX_FROM_BIT(nframes));
-  memset(frames, 0, INDEX_FROM_BIT(nframes));
+  // Size the frame allocator from the memory map the loader gave us.
+  nframes = multiboot_end_frame();
+  init_buddy(nframes);
+  frame_refs = (u16int*)kmalloc(nframes * sizeof(u16int));
+  memset(frame_refs, 0, nframes * sizeof(u16int));
 
   // Let's make a page directory.
   kernel_directory = (page_directory_t*)kmalloc_align(sizeof(page_directory_t));
   memset(kernel_directory, 0, sizeof(page_directory_t));
-  //current_directory = kernel_directory;
-  kernel_directory->physicalAddr = (u32int)kernel_directory->tablesPhysical;
+  kernel_directory->tablesPhysical[PAGE_DIR_SELF] = (u32int)kernel_directory | 0x3;
 
-  int i = 0;
-  for (i = KHEAP_START; i < KHEAP_START + KHEAP_INITIAL_SIZE; i += 0x1000) {
+  // Create every page table of the kernel heap, the page-run range,
+  // the vmalloc range and the frame window now, so that all page
+  // directories cloned later share them and growing any of them never
+  // needs a new table.
+  for (i = KHEAP_START; i < VMALLOC_START + VMALLOC_SIZE; i += 0x400000) {
     get_page(i, 1, kernel_directory);
   }
+  get_page(FRAME_WINDOW_START, 1, kernel_directory);
 
+  // Identity map everything up to the end of the placement area. Those
+  // frames are never given to the buddy allocator, so they stay ours;
+  // the usable RAM above is handed over region by region.
+  u32int features = cpu_features();
   i = 0;
+  if (features & CPUID_PSE) {
+    // Cover the placement area with 4MB pages instead: one TLB entry
+    // each and no tables to allocate. The last one reaches past the end
+    // of the area, so kernel_end below moves up with it and the frames
+    // under it are kept from the buddy allocator too.
+    u32int cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" : : "r"(cr4 | 0x10));
+    for (; i < placement_address + 0x1000; i += 0x400000) {
+      // Present, RW, global; kernel only.
+      kernel_directory->tablesPhysical[i / 0x400000] =
+          i | PAGE_DIR_LARGE | 0x103;
+    }
+  }
+  // Placing a new table moves placement_address, so check it each time.
   while (i < placement_address + 0x1000) {
     // Kernel code is readable but not writeable from userspace.
-    alloc_frame(get_page(i, 1, kernel_directory), 0, 0);
+    page_t *page = get_page(i, 1, kernel_directory);
+    page->present = 1;
+    page->rw = 1;
+    page->user = 1;
+    page->global = 1;
+    page->frame = i / 0x1000;
     i += 0x1000;
   }
+  u32int kernel_end = i;
+  for (i = 0; i < multiboot_region_count(); i++) {
+    u32int first, last;
+    multiboot_region(i, &first, &last);
+    if (first < kernel_end / 0x1000) {
+      first = kernel_end / 0x1000;
+    }
+    if (first < last) {
+      buddy_release_range(first, last - first);
+    }
+  }
 
   for (i = KHEAP_START; i < KHEAP_START + KHEAP_INITIAL_SIZE; i += 0x1000) {
-    alloc_frame( get_page(i, 1, kernel_directory), 0, 0);
+    reserve_page( get_page(i, 1, kernel_directory), 0, 1);
   }
 
   // Before we enable paging, we must register our page fault handler.
@@ -139,75 +378,183 @@ void initialise_paging() {
 
   // Now, enable paging!
   switch_page_directory(kernel_directory);
+  paging_enabled = 1;
+
+  // Kernel mappings are the same in every directory, so let them
+  // survive task switches if the CPU can.
+  if (features & CPUID_PGE) {
+    u32int cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" : : "r"(cr4 | 0x80));
+    global_pages = 1;
+  }
+
+  kheap = create_heap(KHEAP_START, KHEAP_START + KHEAP_INITIAL_SIZE, KHEAP_MAX,
+      0, 0, kernel_directory);
+  initialise_vmem();
 
-  kheap = create_heap(KHEAP_START, KHEAP_START + KHEAP_INITIAL_SIZE, 0xcffff000, 0, 0);
+  directory_cache = kmem_cache_create("page_directory",
+      sizeof(page_directory_t), KMEM_CACHE_PAGE_ALIGN, NULL);
 
   current_directory = clone_directory(kernel_directory);
   //current_directory = kernel_directory;
   switch_page_directory(current_directory);
 }
 
-static page_table_t* clone_table(page_table_t *src, uint32_t *physAddr) {
-  page_table_t *table = (page_table_t*)kmalloc_ap(sizeof(page_table_t), physAddr);
-  memset(table, 0, sizeof(page_directory_t));
+// Returns the entries of page table table_idx of dir, which must exist.
+static page_t *table_entries(page_directory_t *dir, u32int table_idx) {
+    u32int pde = dir->tablesPhysical[table_idx];
+    if (!paging_enabled) {
+        return (page_t*)(pde & 0xFFFFF000);
+    }
+    // Kernel tables are shared by every directory, so whatever the
+    // current directory has at the same index will do.
+    if (dir == current_directory ||
+        (pde & 0xFFFFF000) ==
+            (current_directory->tablesPhysical[table_idx] & 0xFFFFF000)) {
+        return PAGE_TABLES + table_idx * 1024;
+    }
+    u32int *alt = &current_directory->tablesPhysical[PAGE_DIR_ALT];
+    if ((*alt & 0xFFFFF000) != DIRECTORY_PHYSICAL(dir)) {
+        *alt = DIRECTORY_PHYSICAL(dir) | 0x3;
+        // Drop whatever was cached for the previous alternate directory.
+        // Directory entries never have the global bit, so this is enough.
+        u32int cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+    return ALT_PAGE_TABLES + table_idx * 1024;
+}
 
-  int i;
+// Gives dir a zeroed page table at table_idx.
+static void make_table(page_directory_t *dir, u32int table_idx) {
+    if (!paging_enabled) {
+        uint32_t phys;
+        void *table = (void*)kmalloc_ap(sizeof(page_table_t), &phys);
+        memset(table, 0, sizeof(page_table_t));
+        dir->tablesPhysical[table_idx] = phys | 0x7; // PRESENT, RW, US.
+        return;
+    }
+    dir->tablesPhysical[table_idx] = zeroed_frame() * 0x1000 | 0x7;
+    flush_tlb_page((u32int)table_entries(dir, table_idx));
+}
+
+// Fills table table_idx of dir from the same table of the current
+// directory.
+static void clone_table(page_directory_t *dir, u32int table_idx) {
+  page_t *src = PAGE_TABLES + table_idx * 1024;
+  make_table(dir, table_idx);
+  page_t *table = table_entries(dir, table_idx);
+
+  int i, protected = 0;
   for (i = 0; i < 1024; i++) {
-    if (!src->pages[i].frame) {
+    if (!src[i].frame) {
+      // A reserved page stays reserved in the copy.
+      table[i] = src[i];
+      continue;
+    }
+
+    // The stack we are running on is copied right away. Both tasks
+    // write to it immediately, and a write fault on it could not be
+    // handled: the CPU pushes the fault frame onto that same stack.
+    u32int address = (table_idx * 1024 + i) * 0x1000;
+    if (address < TASK_STACK_TOP - TASK_STACK_SIZE || address > TASK_STACK_TOP) {
+      // Share everything else. Writeable pages turn read-only in both
+      // directories until one of them writes, see copy_on_write().
+      // Shared memory stays writeable for both.
+      if (src[i].rw && !src[i].shared) {
+        src[i].rw = 0;
+        src[i].cow = 1;
+        protected++;
+      }
+      table[i] = src[i];
+      if (frame_refs[src[i].frame]) {
+        frame_refs[src[i].frame]++;
+      }
       continue;
     }
 
-    alloc_frame(&table->pages[i], 0, 0);
+    alloc_frame(&table[i], !src[i].user, src[i].rw);
 
-    if (src->pages[i].present) table->pages[i].present = 1;
-    if (src->pages[i].rw) table->pages[i].rw = 1;
-    if (src->pages[i].user) table->pages[i].user = 1;
-    if (src->pages[i].accessed) table->pages[i].accessed = 1;
-    if (src->pages[i].dirty) table->pages[i].dirty = 1;
+    if (src[i].present) table[i].present = 1;
+    if (src[i].accessed) table[i].accessed = 1;
+    if (src[i].dirty) table[i].dirty = 1;
 
-    copy_page_physical(src->pages[i].frame * 0x1000, table->pages[i].frame * 0x1000);
+    copy_page_physical(src[i].frame * 0x1000, table[i].frame * 0x1000);
   }
 
-  return table;
+  if (protected) {
+    u32int start = table_idx * 0x400000;
+    flush_tlb_range(start, start + 0x400000);
+  }
 }
 
 page_directory_t* clone_directory(page_directory_t *src) {
-  uint32_t phys;
+  // The source tables are read through the self-map.
+  ASSERT(src == current_directory);
 
-  page_directory_t *dir = (page_directory_t*)kmalloc_ap(sizeof(page_directory_t),
-      &phys);
+  page_directory_t *dir = (page_directory_t*)kmem_cache_alloc(directory_cache);
   memset(dir, 0, sizeof(page_directory_t));
-
-  uint32_t offset = (uint32_t)dir->tablesPhysical - (uint32_t)dir;
-
-  dir->physicalAddr = phys + offset;
+  dir->tablesPhysical[PAGE_DIR_SELF] = kernel_physical((u32int)dir) | 0x3;
 
   int i;
-  for (i = 0; i < 1024; i++) {
-    if (!src->tables[i]) {
+  for (i = 0; i < PAGE_DIR_ALT; i++) {
+    if (!src->tablesPhysical[i]) {
       continue;
     }
 
-    if (kernel_directory->tables[i] == src->tables[i]) {
-      dir->tables[i] = src->tables[i];
+    if ((kernel_directory->tablesPhysical[i] & 0xFFFFF000) ==
+        (src->tablesPhysical[i] & 0xFFFFF000)) {
       dir->tablesPhysical[i] = src->tablesPhysical[i];
     } else {
-      uint32_t phys;
-      dir->tables[i] = clone_table(src->tables[i], &phys);
-      dir->tablesPhysical[i] = phys | 0x07;
+      clone_table(dir, i);
     }
   }
 
   return dir;
 }
 
+void free_directory(page_directory_t *dir) {
+  ASSERT(dir != current_directory);
+
+  u32int i, j;
+  for (i = 0; i < PAGE_DIR_ALT; i++) {
+    u32int pde = dir->tablesPhysical[i];
+    if (!pde || (kernel_directory->tablesPhysical[i] & 0xFFFFF000) ==
+        (pde & 0xFFFFF000)) {
+      continue;
+    }
+    page_t *table = table_entries(dir, i);
+    for (j = 0; j < 1024; j++) {
+      free_frame(&table[j]);
+    }
+    free_frames(pde >> 12, 0);
+  }
+
+  // Don't leave the alternate slot pointing at a freed directory.
+  u32int *alt = &current_directory->tablesPhysical[PAGE_DIR_ALT];
+  if ((*alt & 0xFFFFF000) == DIRECTORY_PHYSICAL(dir)) {
+    *alt = 0;
+    u32int cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+  }
+  kmem_cache_free(directory_cache, dir);
+}
+
 void switch_page_directory(page_directory_t *dir)
 {
     current_directory = dir;
-    asm volatile("mov %0, %%cr3":: "r"(dir->physicalAddr));
+    u32int cr3;
+    asm volatile("mov %%cr3, %0": "=r"(cr3));
+    if (paging_enabled && cr3 == DIRECTORY_PHYSICAL(dir)) {
+        return;
+    }
+    asm volatile("mov %0, %%cr3":: "r"(DIRECTORY_PHYSICAL(dir)));
     u32int cr0;
     asm volatile("mov %%cr0, %0": "=r"(cr0));
     cr0 |= 0x80000000; // Enable paging!
+    cr0 |= 0x10000;    // Fault on kernel writes to read-only pages too.
     asm volatile("mov %0, %%cr0":: "r"(cr0));
 }
 
@@ -216,35 +563,72 @@ page_t *get_page(u32int address, int make, page_directory_t *dir) {
     address /= 0x1000;
     // Find the page table containing this address.
     u32int table_idx = address / 1024;
-    if (dir->tables[table_idx]) {
-        return &dir->tables[table_idx]->pages[address % 1024];
+    if (dir->tablesPhysical[table_idx] & PAGE_DIR_LARGE) {
+        ASSERT(!make);
+        return NULL;
     }
-    if (make) {
-        uint32_t tmp;
-        monitor_write("going to do this here\n");
-        dir->tables[table_idx] = (page_table_t*)kmalloc_ap(sizeof(page_table_t), &tmp);
-        memset(dir->tables[table_idx], 0, 0x1000);
-        dir->tablesPhysical[table_idx] = tmp | 0x7; // PRESENT, RW, US.
-        return &dir->tables[table_idx]->pages[address % 1024];
+    if (!dir->tablesPhysical[table_idx]) {
+        if (!make) {
+            return NULL;
+        }
+        make_table(dir, table_idx);
     }
-
-    return NULL;
+    return table_entries(dir, table_idx) + address % 1024;
 }
 
 
-void page_fault(registers_t regs)
+// Gives page a private, writeable frame after a write to a shared
+// copy-on-write page. The last task to write keeps the original frame.
+static void copy_on_write(page_t *page, u32int address) {
+    u32int frame = page->frame;
+    if (frame_refs[frame] > 1) {
+        u32int idx = take_frame();
+        copy_page_physical(frame * 0x1000, idx * 0x1000);
+        frame_refs[frame]--;
+        frame_refs[idx] = 1;
+        page->frame = idx;
+    }
+    page->rw = 1;
+    page->cow = 0;
+    flush_tlb_page(address);
+}
+
+void page_fault(registers_t *regs)
 {
     // A page fault has occurred.
     // The faulting address is stored in the CR2 register.
     u32int faulting_address;
     asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
-    
+
+    page_t *page = get_page(faulting_address, 0, current_directory);
+    if (!(regs->err_code & 0x1)) {
+        // The first touch of a page in one of the task's mappings.
+        if ((!page || (!page->lazy && !page->frame)) &&
+            vma_reserve(faulting_address)) {
+            page = get_page(faulting_address, 0, current_directory);
+            if (page->present) {
+                // Shared memory, mapped right away.
+                return;
+            }
+        }
+        // First touch of a reserved page.
+        if (page && page->lazy) {
+            fault_in(page, faulting_address);
+            return;
+        }
+    }
+    // A write to a present page that was shared by fork().
+    if ((regs->err_code & 0x3) == 0x3 && page && page->cow) {
+        copy_on_write(page, faulting_address);
+        return;
+    }
+
     // The error code gives us details of what happened.
-    int present   = !(regs.err_code & 0x1); // Page not present
-    int rw = regs.err_code & 0x2;           // Write operation?
-    int us = regs.err_code & 0x4;           // Processor was in user-mode?
-    int reserved = regs.err_code & 0x8;     // Overwritten CPU-reserved bits of page entry?
-    int id = regs.err_code & 0x10;          // Caused by an instruction fetch?
+    int present   = !(regs->err_code & 0x1); // Page not present
+    int rw = regs->err_code & 0x2;           // Write operation?
+    int us = regs->err_code & 0x4;           // Processor was in user-mode?
+    int reserved = regs->err_code & 0x8;     // Overwritten CPU-reserved bits of page entry?
+    int id = regs->err_code & 0x10;          // Caused by an instruction fetch?
 
     // Output an error message.
     monitor_write("Page fault! ( ");
@@ -7,14 +7,27 @@
 #include "common.h"
 #include "isr.h"
 
+/**
+   A few pages of kernel virtual memory used to reach frames that are not
+   mapped anywhere else, see copy_page_physical().
+**/
+#define FRAME_WINDOW_START 0xDC000000
+#define FRAME_WINDOW_PAGES 2
+
 typedef struct page
 {
     u32int present    : 1;   // Page present in memory
     u32int rw         : 1;   // Read-only if clear, readwrite if set
     u32int user       : 1;   // Supervisor level only if clear
+    u32int writethrough : 1; // Write-through caching if set
+    u32int nocache    : 1;   // Caching disabled if set
     u32int accessed   : 1;   // Has the page been accessed since last refresh?
     u32int dirty      : 1;   // Has the page been written to since last refresh?
-    u32int unused     : 7;   // Amalgamation of unused and reserved bits
+    u32int pat        : 1;   // Page attribute table index
+    u32int global     : 1;   // Kept in the TLB across CR3 reloads (with CR4.PGE)
+    u32int cow        : 1;   // Available to us: shared read-only, copy on write
+    u32int lazy       : 1;   // Available to us: gets a frame on first touch
+    u32int shared     : 1;   // Available to us: shared memory, never copied
     u32int frame      : 20;  // Frame address (shifted right 12 bits)
 } page_t;
 
@@ -23,26 +36,36 @@ typedef struct page_table
     page_t pages[1024];
 } page_table_t;
 
+/**
+   The last directory entry maps the directory itself, so the tables of
+   the current directory appear as one array of page_t at PAGE_TABLES.
+   The one before it is pointed at another directory whenever that one's
+   tables need editing, which makes them appear at ALT_PAGE_TABLES.
+**/
+#define PAGE_DIR_SELF 1023
+#define PAGE_DIR_ALT  1022
+#define PAGE_TABLES     ((page_t*)0xFFC00000)
+#define ALT_PAGE_TABLES ((page_t*)0xFF800000)
+
 typedef struct page_directory
 {
     /**
-       Array of pointers to pagetables.
-    **/
-    page_table_t *tables[1024];
-    /**
-       Array of pointers to the pagetables above, but gives their *physical*
-       location, for loading into the CR3 register.
+       Physical addresses and flags of the page tables, as loaded
+       through CR3.
     **/
     u32int tablesPhysical[1024];
-
-    /**
-       The physical address of tablesPhysical. This comes into play
-       when we get our kernel heap allocated and the directory
-       may be in a different location in virtual memory.
-    **/
-    u32int physicalAddr;
 } page_directory_t;
 
+/**
+   The physical address of a page directory, for loading into CR3.
+**/
+#define DIRECTORY_PHYSICAL(dir) ((dir)->tablesPhysical[PAGE_DIR_SELF] & 0xFFFFF000)
+
+/**
+   Set in a directory entry that maps a 4MB page instead of a table.
+**/
+#define PAGE_DIR_LARGE 0x80
+
 /**
    Sets up the environment, page directories etc and
    enables paging.
@@ -59,14 +82,94 @@ void switch_page_directory(page_directory_t *new);
    Retrieves a pointer to the page required.
    If make == 1, if the page-table in which this page should
    reside isn't created, create it!
+   For a directory other than the current one, the pointer is only good
+   until get_page() is called for yet another directory.
+   Addresses inside a 4MB page have no page_t; NULL is returned for them.
 **/
 page_t *get_page(u32int address, int make, page_directory_t *dir);
 
+/**
+   Gives page a free frame, unless it already has one.
+**/
+void alloc_frame(page_t *page, int is_kernel, int is_writeable);
+
+/**
+   Releases the frame behind page, if any, and marks it not present.
+**/
+void free_frame(page_t *page);
+
+/**
+   Reserves page without giving it a frame. The page fault handler
+   backs it with a zeroed frame the first time it is touched.
+**/
+void reserve_page(page_t *page, int is_kernel, int is_writeable);
+
+/**
+   Returns a zeroed frame that no page maps yet. The caller holds the
+   only reference to it, and drops it with put_frame().
+**/
+u32int alloc_shared_frame();
+
+/**
+   Maps frame at page as shared memory: read-write for user mode, never
+   copied on fork, and counted as one more reference to the frame.
+**/
+void map_shared_frame(page_t *page, u32int frame);
+
+/**
+   Drops a reference to frame, freeing it if that was the last one.
+**/
+void put_frame(u32int frame);
+
+/**
+   Returns the physical address behind a kernel virtual address. A
+   reserved page is given its frame first, so the result is stable.
+**/
+u32int kernel_physical(u32int address);
+
+/**
+   Drops any TLB entry for the page containing address.
+**/
+void flush_tlb_page(u32int address);
+
+/**
+   Drops the TLB entries for every page in [start, end).
+**/
+void flush_tlb_range(u32int start, u32int end);
+
+/**
+   Copies the frame at physical address src to the one at dst.
+**/
+void copy_page_physical(u32int src, u32int dst);
+
+/**
+   Zeroes a few frames ahead of time, so that new page tables and
+   demand-paged memory can usually skip clearing 4 KiB on the spot.
+   Called by the idle task; returns once the pool is full.
+**/
+void refill_zero_pool();
+
+/**
+   Print how often a zeroed frame was taken from the pool, and how often
+   one had to be cleared on the spot.
+**/
+void zero_pool_dump_stats();
+
 /**
    Handler for page faults.
 **/
-void page_fault(registers_t regs);
+void page_fault(registers_t *regs);
 
+/**
+   Makes a copy of src for a new task. Private pages are shared with
+   src and copied on the first write from either side.
+**/
 page_directory_t* clone_directory(page_directory_t *src);
 
+/**
+   Releases a directory made by clone_directory(), along with its private
+   tables and its references to their frames. dir must not be current.
+**/
+void free_directory(page_directory_t *dir);
+
 #endif
@@ -0,0 +1,148 @@
+// shm.c -- Shared memory objects.
+//
+// An object owns one reference to each of its frames, and every page
+// table entry mapping a frame owns another, so a frame lives until the
+// object is gone and the last task has unmapped it.
+
+#include "shm.h"
+#include "kheap.h"
+#include "slab.h"
+#include "vma.h"
+#include "task.h"
+
+static kmem_cache_t *shm_cache;
+static shm_t *objects = NULL;
+static uint32_t next_handle = 1;
+
+static shm_t *find(uint32_t handle) {
+  shm_t *shm;
+  for (shm = objects; shm; shm = shm->next) {
+    if (shm->handle == handle) {
+      return shm;
+    }
+  }
+  return NULL;
+}
+
+static int holds(shm_t *shm, int pid) {
+  uint32_t i;
+  for (i = 0; i < shm->nholders; i++) {
+    if (shm->holders[i] == pid) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void add_holder(shm_t *shm, int pid) {
+  if (holds(shm, pid)) {
+    return;
+  }
+  shm->holders = (int*)krealloc((uint32_t)shm->holders,
+      (shm->nholders + 1) * sizeof(int));
+  shm->holders[shm->nholders++] = pid;
+}
+
+// Finds handle, if the current task was given it.
+static shm_t *find_held(uint32_t handle) {
+  shm_t *shm = find(handle);
+  if (shm == NULL || !holds(shm, getpid())) {
+    return NULL;
+  }
+  return shm;
+}
+
+void initialise_shm() {
+  shm_cache = kmem_cache_create("shm", sizeof(shm_t), 0, NULL);
+}
+
+uint32_t shm_create(uint32_t size) {
+  uint32_t pages = (size + 0xFFF) / 0x1000;
+  if (pages == 0 || pages > (USER_MMAP_END - USER_MMAP_START) / 0x1000) {
+    return 0;
+  }
+
+  shm_t *shm = (shm_t*)kmem_cache_alloc(shm_cache);
+  shm->handle = next_handle++;
+  shm->pages = pages;
+  shm->frames = (uint32_t*)kcalloc(pages, sizeof(uint32_t));
+  shm->refs = 1;
+  shm->creator = getpid();
+  shm->holders = NULL;
+  shm->nholders = 0;
+  add_holder(shm, shm->creator);
+  shm->next = objects;
+  objects = shm;
+  return shm->handle;
+}
+
+int shm_grant(uint32_t handle, int pid) {
+  shm_t *shm = find_held(handle);
+  if (shm == NULL || !task_exists(pid)) {
+    return -1;
+  }
+  add_holder(shm, pid);
+  return 0;
+}
+
+void shm_fork(int parent, int child) {
+  shm_t *shm;
+  for (shm = objects; shm; shm = shm->next) {
+    if (holds(shm, parent)) {
+      add_holder(shm, child);
+    }
+  }
+}
+
+uint32_t shm_attach(uint32_t handle) {
+  shm_t *shm = find_held(handle);
+  if (shm == NULL) {
+    return 0;
+  }
+  return vma_map(0, shm->pages * 0x1000, shm);
+}
+
+int shm_destroy(uint32_t handle) {
+  shm_t **link = &objects;
+  while (*link && (*link)->handle != handle) {
+    link = &(*link)->next;
+  }
+  if (*link == NULL) {
+    return -1;
+  }
+  shm_t *shm = *link;
+  // Every area mapping the object holds a reference besides the handle.
+  if (shm->creator != getpid() || shm->refs > 1) {
+    return -1;
+  }
+  *link = shm->next;
+  kfree((uint32_t)shm->holders);
+  shm_put(shm);
+  return 0;
+}
+
+void shm_get(shm_t *shm) {
+  shm->refs++;
+}
+
+void shm_put(shm_t *shm) {
+  if (--shm->refs > 0) {
+    return;
+  }
+  uint32_t i;
+  for (i = 0; i < shm->pages; i++) {
+    if (shm->frames[i]) {
+      put_frame(shm->frames[i]);
+    }
+  }
+  kfree((uint32_t)shm->frames);
+  kmem_cache_free(shm_cache, shm);
+}
+
+void shm_map_page(shm_t *shm, uint32_t index, page_t *page) {
+  ASSERT(index < shm->pages);
+  if (shm->frames[index] == 0) {
+    shm->frames[index] = alloc_shared_frame();
+  }
+  map_shared_frame(page, shm->frames[index]);
+}
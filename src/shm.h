@@ -0,0 +1,70 @@
+// shm.h -- Shared memory objects. Every task that attaches an object
+//          maps the same frames, so data can move between tasks
+//          without being copied.
+
+#ifndef SHM_H
+#define SHM_H
+
+#include "common.h"
+#include "paging.h"
+
+typedef struct shm
+{
+  uint32_t handle;      // What tasks use to name the object.
+  uint32_t pages;
+  uint32_t *frames;     // Frame behind each page, 0 until first touched.
+  uint32_t refs;        // The handle, plus each area mapping the object.
+  int creator;          // The only task that may destroy the object.
+  int *holders;         // Tasks that were given the handle.
+  uint32_t nholders;
+  struct shm *next;     // All objects that still have a handle.
+} shm_t;
+
+/**
+   Sets up the cache objects are allocated from.
+**/
+void initialise_shm();
+
+/**
+   Creates an object of size bytes and returns its handle, or 0. Only the
+   current task holds the handle at first.
+**/
+uint32_t shm_create(uint32_t size);
+
+/**
+   Gives the handle to task pid, which must exist. Only a task that
+   holds the handle may pass it on. Returns 0, or -1.
+**/
+int shm_grant(uint32_t handle, int pid);
+
+/**
+   Lets child hold every handle parent holds, for fork().
+**/
+void shm_fork(int parent, int child);
+
+/**
+   Maps the whole object into the current task and returns the
+   address, or 0 if the task doesn't hold the handle. Unmap it again
+   with munmap().
+**/
+uint32_t shm_attach(uint32_t handle);
+
+/**
+   Removes the handle and frees the memory. Only the creator may do
+   this, and only once no task maps the object any more. Returns 0, or
+   -1 if the handle can't be destroyed.
+**/
+int shm_destroy(uint32_t handle);
+
+/**
+   Takes and drops references for areas mapping shm.
+**/
+void shm_get(shm_t *shm);
+void shm_put(shm_t *shm);
+
+/**
+   Maps page index of shm at page, giving it a frame if it has none.
+**/
+void shm_map_page(shm_t *shm, uint32_t index, page_t *page);
+
+#endif // SHM_H
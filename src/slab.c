@@ -0,0 +1,126 @@
+// slab.c -- Object caches for fixed-size kernel objects.
+//
+// Every cache keeps a singly linked free list of objects threaded through
+// the objects themselves. Slabs are carved out of the kernel heap and are
+// never given back, so after warm-up an allocation or a free is just a
+// couple of pointer operations.
+
+#include "slab.h"
+#include "kheap.h"
+#include "paging.h"
+#include "monitor.h"
+
+// Aim for slabs of about this many bytes.
+#define SLAB_TARGET_SIZE 0x4000
+
+static kmem_cache_t *caches = NULL;
+
+kmem_cache_t *kmem_cache_create(char *name, uint32_t size,
+    uint32_t flags, kmem_ctor_t ctor) {
+  ASSERT(size > 0);
+
+  kmem_cache_t *cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+  memset(cache, 0, sizeof(kmem_cache_t));
+  cache->name = name;
+  cache->object_size = size;
+  cache->flags = flags;
+  cache->ctor = ctor;
+
+  uint32_t stride = (size + 3) & ~3;
+  if (ctor) {
+    cache->link_offset = stride;
+    stride += sizeof(void*);
+  } else {
+    cache->link_offset = 0;
+  }
+  if (stride < sizeof(void*)) {
+    stride = sizeof(void*);
+  }
+  if (flags & KMEM_CACHE_PAGE_ALIGN) {
+    stride = (stride + 0xFFF) & 0xFFFFF000;
+  }
+  cache->stride = stride;
+
+  cache->objects_per_slab = SLAB_TARGET_SIZE / stride;
+  if (cache->objects_per_slab == 0) {
+    cache->objects_per_slab = 1;
+  }
+
+  cache->next = caches;
+  caches = cache;
+
+  return cache;
+}
+
+#define LINK(cache, obj) (*(void**)((uint32_t)(obj) + (cache)->link_offset))
+
+static void cache_grow(kmem_cache_t *cache) {
+  uint32_t slab_size = cache->stride * cache->objects_per_slab;
+  uint32_t slab = kmalloc_int(slab_size,
+      (cache->flags & KMEM_CACHE_PAGE_ALIGN) ? 1 : 0, 0);
+
+  // Push the objects in reverse so they are handed out in address order.
+  uint32_t i = cache->objects_per_slab;
+  while (i-- > 0) {
+    void *obj = (void*)(slab + i * cache->stride);
+    if (cache->ctor) {
+      cache->ctor(obj);
+    }
+    LINK(cache, obj) = cache->free_list;
+    cache->free_list = obj;
+  }
+
+  cache->slabs++;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+  if (cache->free_list == NULL) {
+    cache_grow(cache);
+  }
+
+  void *obj = cache->free_list;
+  cache->free_list = LINK(cache, obj);
+
+  cache->objects_in_use++;
+  cache->allocs++;
+  return obj;
+}
+
+void *kmem_cache_alloc_phys(kmem_cache_t *cache, uint32_t *phys) {
+  void *obj = kmem_cache_alloc(cache);
+  *phys = kernel_physical((u32int)obj);
+  return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+  if (obj == NULL) {
+    return;
+  }
+  ASSERT(cache->objects_in_use > 0);
+
+  LINK(cache, obj) = cache->free_list;
+  cache->free_list = obj;
+
+  cache->objects_in_use--;
+  cache->frees++;
+}
+
+void kmem_cache_dump_stats() {
+  kmem_cache_t *cache;
+  for (cache = caches; cache; cache = cache->next) {
+    monitor_write(cache->name);
+    monitor_write(": size ");
+    monitor_write_dec(cache->object_size);
+    monitor_write(" slabs ");
+    monitor_write_dec(cache->slabs);
+    monitor_write(" in use ");
+    monitor_write_dec(cache->objects_in_use);
+    monitor_write("/");
+    monitor_write_dec(cache->slabs * cache->objects_per_slab);
+    monitor_write(" allocs ");
+    monitor_write_dec(cache->allocs);
+    monitor_write(" frees ");
+    monitor_write_dec(cache->frees);
+    monitor_write("\n");
+  }
+}
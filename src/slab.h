@@ -0,0 +1,71 @@
+// slab.h -- Object caches for fixed-size kernel objects, so that
+//           hot allocations (tasks, page tables, page directories)
+//           don't have to go through the general heap every time.
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "common.h"
+
+/**
+   Objects from this cache are page aligned, and every slab is
+   made up of whole pages.
+**/
+#define KMEM_CACHE_PAGE_ALIGN 0x1
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+typedef struct kmem_cache {
+  char *name;
+  uint32_t object_size;
+  uint32_t stride;         // Distance between two objects in a slab.
+  uint32_t objects_per_slab;
+  uint32_t flags;
+  /**
+     Offset of the free-list link inside a free object. Caches with a
+     constructor keep it past the end of the object, so that freed
+     objects stay constructed.
+  **/
+  uint32_t link_offset;
+  kmem_ctor_t ctor;
+  void *free_list;
+
+  // Statistics.
+  uint32_t slabs;
+  uint32_t objects_in_use;
+  uint32_t allocs;
+  uint32_t frees;
+
+  struct kmem_cache *next; // All caches, for kmem_cache_dump_stats().
+} kmem_cache_t;
+
+/**
+   Create a cache of objects size bytes big. If ctor is non-zero it is
+   called once on every object when its slab is created, and objects
+   must be handed back to kmem_cache_free() in their constructed state.
+**/
+kmem_cache_t *kmem_cache_create(char *name, uint32_t size,
+    uint32_t flags, kmem_ctor_t ctor);
+
+/**
+   Take an object from the cache, growing it by one slab if needed.
+**/
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/**
+   As kmem_cache_alloc, but also stores the physical address of the
+   object in phys. Phys MUST be a valid pointer to uint32_t!
+**/
+void *kmem_cache_alloc_phys(kmem_cache_t *cache, uint32_t *phys);
+
+/**
+   Give an object back to the cache it was allocated from.
+**/
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/**
+   Print the statistics of every cache to the monitor.
+**/
+void kmem_cache_dump_stats();
+
+#endif // SLAB_H
@@ -6,19 +6,41 @@
 
 #include "monitor.h"
 
-static void syscall_handler(registers_t regs);
+#include "vma.h"
+#include "shm.h"
+#include "task.h"
+
+static void syscall_handler(registers_t *regs);
 
 DEFN_SYSCALL1(monitor_write, 0, const char*);
 DEFN_SYSCALL1(monitor_write_hex, 1, uint32_t);
 DEFN_SYSCALL1(monitor_write_dec, 2, uint32_t);
+DEFN_SYSCALL2(mmap, 3, uint32_t, uint32_t);
+DEFN_SYSCALL2(munmap, 4, uint32_t, uint32_t);
+DEFN_SYSCALL1(brk, 5, uint32_t);
+DEFN_SYSCALL1(shm_create, 6, uint32_t);
+DEFN_SYSCALL1(shm_attach, 7, uint32_t);
+DEFN_SYSCALL1(shm_destroy, 8, uint32_t);
+DEFN_SYSCALL0(exit, 9);
+DEFN_SYSCALL0(idle_wakeups, 10);
+DEFN_SYSCALL2(shm_grant, 11, uint32_t, int);
 
-static void *syscalls[3] =
+static void *syscalls[12] =
 {
     &monitor_write,
     &monitor_write_hex,
     &monitor_write_dec,
+    &mmap,
+    &munmap,
+    &brk,
+    &shm_create,
+    &shm_attach,
+    &shm_destroy,
+    &exit_task,
+    &get_idle_wakeups,
+    &shm_grant,
 };
-u32int num_syscalls = 3;
+u32int num_syscalls = 12;
 
 void initialise_syscalls()
 {
@@ -26,15 +48,15 @@ void initialise_syscalls()
     register_interrupt_handler (0x80, &syscall_handler);
 }
 
-void syscall_handler(registers_t regs)
+void syscall_handler(registers_t *regs)
 {
     // Firstly, check if the requested syscall number is valid.
     // The syscall number is found in EAX.
-    if (regs.eax >= num_syscalls)
+    if (regs->eax >= num_syscalls)
         return;
 
     // Get the required syscall location.
-    void *location = syscalls[regs.eax];
+    void *location = syscalls[regs->eax];
 
     // We don't know how many parameters the function wants, so we just
     // push them all onto the stack in the correct order. The function will
@@ -52,6 +74,6 @@ void syscall_handler(registers_t regs)
       pop %%ebx; \
       pop %%ebx; \
       pop %%ebx; \
-    " : "=a" (ret) : "r" (regs.edi), "r" (regs.esi), "r" (regs.edx), "r" (regs.ecx), "r" (regs.ebx), "r" (location));
-    regs.eax = ret;
+    " : "=a" (ret) : "r" (regs->edi), "r" (regs->esi), "r" (regs->edx), "r" (regs->ecx), "r" (regs->ebx), "r" (location));
+    regs->eax = ret;
 }
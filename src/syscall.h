@@ -66,5 +66,14 @@ int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4, P5 p5) \
 DECL_SYSCALL1(monitor_write, const char*)
 DECL_SYSCALL1(monitor_write_hex, uint32_t)
 DECL_SYSCALL1(monitor_write_dec, uint32_t)
+DECL_SYSCALL2(mmap, uint32_t, uint32_t)
+DECL_SYSCALL2(munmap, uint32_t, uint32_t)
+DECL_SYSCALL1(brk, uint32_t)
+DECL_SYSCALL1(shm_create, uint32_t)
+DECL_SYSCALL1(shm_attach, uint32_t)
+DECL_SYSCALL1(shm_destroy, uint32_t)
+DECL_SYSCALL0(exit)
+DECL_SYSCALL0(idle_wakeups)
+DECL_SYSCALL2(shm_grant, uint32_t, int)
 
 #endif
@@ -1,75 +1,168 @@
 #include "task.h"
 #include "common.h"
+#include "slab.h"
+#include "shm.h"
+#include "timer.h"
+#include "fpu.h"
 
 volatile task_t *current_task;
 
-// The start of the task linked list.
-volatile task_t *ready_queue;
+// Runnable tasks, in one circular list per priority. Bit n of
+// run_bitmap is set when run_queues[n] isn't empty, so the most urgent
+// task is found with a single bit scan.
+static task_t *run_queues[TASK_PRIORITIES];
+static u32int run_bitmap = 0;
+
+// Tasks in sleep_task(), the soonest to wake first.
+static task_t *sleepers = NULL;
+
+// Ticks since the last priority boost.
+static u32int boost_ticks = 0;
+
+// Times the idle task was woken from hlt.
+u32int idle_wakeups = 0;
 
 // Some externs are needed to access members in paging.c...
 extern page_directory_t *kernel_directory;
 extern page_directory_t *current_directory;
 extern void alloc_frame(page_t*,int,int);
 extern u32int initial_esp;
-extern u32int read_eip();
+extern void switch_context(u32int *prev_esp, u32int next_esp,
+                           u32int next_directory);
+extern int fork_context(task_t *child);
 
 // The next available process ID.
 u32int next_pid = 1;
 
-void initialise_tasking() {
-  asm volatile("cli");
+static kmem_cache_t *task_cache;
 
-  // relocate the stack
-  move_stack((void*)0xe0000000, 0x5000);
-
-  current_task = ready_queue = (task_t*)kmalloc(sizeof(task_t));
-  current_task->id = next_pid++;
-  current_task->esp = current_task->ebp = 0;
-  current_task->eip = 0;
-  current_task->page_directory = current_directory;
-  current_task->next = 0;
+static void task_ctor(void *obj) {
+  memset(obj, 0, sizeof(task_t));
+}
 
-  asm volatile("sti");
+// Adds task at the back of its run queue.
+static void enqueue(task_t *task) {
+  task_t **head = &run_queues[task->priority];
+  if (*head == NULL) {
+    task->next = task->prev = task;
+    *head = task;
+    run_bitmap |= 1u << task->priority;
+  } else {
+    task->next = *head;
+    task->prev = (*head)->prev;
+    (*head)->prev->next = task;
+    (*head)->prev = task;
+  }
 }
 
-int fork() {
-  asm volatile("cli");
+static void dequeue(task_t *task) {
+  task_t **head = &run_queues[task->priority];
+  if (task->next == task) {
+    *head = NULL;
+    run_bitmap &= ~(1u << task->priority);
+  } else {
+    task->prev->next = task->next;
+    task->next->prev = task->prev;
+    if (*head == task) {
+      *head = task->next;
+    }
+  }
+  task->next = task->prev = NULL;
+}
 
-  task_t *parent_task = (task_t*)current_task;
+static int timeslice(task_t *task) {
+  if (task->timeslice) {
+    return task->timeslice;
+  }
+  // The urgent levels are the interactive ones: they run often, but only
+  // for a short while.
+  return MIN_TIMESLICE + task->priority / 4;
+}
 
-  page_directory_t *directory = clone_directory(current_directory);
+// Puts every runnable task back at its base priority.
+static void boost_all() {
+  int i;
+  for (i = 0; i < TASK_PRIORITIES; i++) {
+    task_t *task = run_queues[i];
+    if (!task) {
+      continue;
+    }
+    run_queues[i] = NULL;
+    run_bitmap &= ~(1u << i);
+    task->prev->next = NULL;
+    while (task) {
+      task_t *next = task->next;
+      task->priority = task->base_priority;
+      enqueue(task);
+      task = next;
+    }
+  }
+}
 
-  task_t *new_task = (task_t*)kmalloc(sizeof(task_t));
-  new_task->id = next_pid++;
-  new_task->esp = new_task->ebp = 0;
-  new_task->eip = 0;
-  new_task->page_directory = directory;
-  new_task->next = 0;
+void initialise_tasking() {
+  asm volatile("cli");
 
-  task_t *tmp_task = (task_t*)ready_queue;
-  while (tmp_task->next) {
-    tmp_task = tmp_task->next;
+  // relocate the stack
+  move_stack((void*)TASK_STACK_TOP, TASK_STACK_SIZE);
+
+  task_cache = kmem_cache_create("task", sizeof(task_t), 0, &task_ctor);
+  initialise_vma();
+  initialise_shm();
+  initialise_fpu();
+
+  task_t *task = (task_t*)kmem_cache_alloc(task_cache);
+  task->id = next_pid++;
+  task->esp = 0;
+  task->page_directory = current_directory;
+  task->state = TASK_RUNNABLE;
+  task->priority = task->base_priority = DEFAULT_PRIORITY;
+  task->ticks_left = timeslice(task);
+  task->brk = USER_BRK_START;
+  if (fpu_init_task(task) != 0) {
+    PANIC("No memory for the first task");
   }
+  enqueue(task);
+  current_task = task;
 
-  tmp_task->next = new_task;
-
-  uint32_t eip = read_eip();
+  asm volatile("sti");
+}
 
-  if (current_task == parent_task) {
-    uint32_t esp;
-    asm volatile("mov %%esp, %0" : "=r"(esp));
-    uint32_t ebp;
-    asm volatile("mov %%ebp, %0" : "=r"(ebp));
+int fork() {
+  asm volatile("cli");
 
-    new_task->esp = esp;
-    new_task->ebp = ebp;
-    new_task->eip = eip;
+  task_t *parent_task = (task_t*)current_task;
 
+  task_t *new_task = (task_t*)kmem_cache_alloc(task_cache);
+  // The save area is taken up front, so the #NM trap never allocates.
+  if (fpu_fork(parent_task, new_task) != 0) {
+    kmem_cache_free(task_cache, new_task);
     asm volatile("sti");
-    return new_task->id;
+    return -1;
   }
+  new_task->id = next_pid++;
+  new_task->state = TASK_RUNNABLE;
+  new_task->priority = parent_task->priority;
+  new_task->base_priority = parent_task->base_priority;
+  new_task->timeslice = parent_task->timeslice;
+  new_task->ticks_left = timeslice(new_task);
+  new_task->vmas = vma_clone(parent_task->vmas);
+  shm_fork(parent_task->id, new_task->id);
+  new_task->brk = parent_task->brk;
+
+  // The child starts out by returning 0 from fork_context(), on its own
+  // copy of this stack.
+  int parent = fork_context(new_task);
 
-  return 0;
+  asm volatile("sti");
+  return parent ? new_task->id : 0;
+}
+
+// Called by fork_context() with a switch_context() frame pushed, so that
+// the child's copy of the stack has it too.
+void fork_finish(task_t *child, u32int esp) {
+  child->esp = esp;
+  child->page_directory = clone_directory(current_directory);
+  enqueue(child);
 }
 
 void switch_task() {
@@ -77,44 +170,74 @@ void switch_task() {
     return ;
   }
 
-  uint32_t esp, ebp, eip;
-  asm volatile("mov %%esp, %0" : "=r"(esp));
-  asm volatile("mov %%ebp, %0" : "=r"(ebp));
+  // A task that is still runnable goes to the back of its queue, behind
+  // any others of the same priority.
+  task_t *prev = (task_t*)current_task;
+  if (prev->state == TASK_RUNNABLE) {
+    dequeue(prev);
+    enqueue(prev);
+  }
+  ASSERT(run_bitmap != 0);
+  task_t *next = run_queues[__builtin_ctz(run_bitmap)];
+  if (next == prev) {
+    return;
+  }
+
+  current_task = next;
+  current_directory = next->page_directory;
+  fpu_switch(next);
+  // This returns once prev is picked again. Interrupts stay off across
+  // the switch; each task turns them back on from wherever it left.
+  switch_context(&prev->esp, next->esp,
+                 DIRECTORY_PHYSICAL(next->page_directory));
+}
 
-  eip = read_eip();
-  if (eip == 0x12345) {
+void scheduler_tick() {
+  task_t *task = (task_t*)current_task;
+  if (!task) {
     return;
   }
 
-  current_task->eip = eip;
-  current_task->esp = esp;
-  current_task->ebp = ebp;
+  while (sleepers && (int)(sleepers->wake_tick - tick) <= 0) {
+    task_t *sleeper = sleepers;
+    sleepers = sleeper->sleep_next;
+    wake_task(sleeper);
+  }
 
-  current_task = current_task->next;
-  if (!current_task) {
-    current_task = ready_queue;
+  if (++boost_ticks >= BOOST_TICKS) {
+    boost_ticks = 0;
+    boost_all();
+  }
+
+  // Keep running until the slice is up, unless something more urgent
+  // has been woken.
+  if (--task->ticks_left > 0 &&
+      (int)__builtin_ctz(run_bitmap) >= task->priority) {
+    return;
   }
 
-  eip = current_task->eip;
-  esp = current_task->esp;
-  ebp = current_task->ebp;
+  if (task->ticks_left <= 0) {
+    // It used the whole slice, so it's CPU bound. The idle level is kept
+    // for the idle task.
+    if (task->priority < IDLE_PRIORITY - 1) {
+      dequeue(task);
+      task->priority++;
+      enqueue(task);
+    }
+    task->ticks_left = timeslice(task);
+  }
 
-  current_directory = current_task->page_directory;
-  // Here we:
-  // * Stop interrupts so we don't get interrupted.
-  // * Temporarily put the new EIP location in ECX.
-  // * Load the stack and base pointers from the new task struct.
-  // * Change page directory to the physical address (physicalAddr) of the new directory.
-  // * Put a dummy value (0x12345) in EAX so that above we can recognise that we've just
-  // switched task.
-  // * Restart interrupts. The STI instruction has a delay - it doesn't take effect until after
-  // the next instruction.
-  // * Jump to the location in ECX (remember we put the new EIP in there).
-  do_fucking_jump(eip, ebp, esp, current_directory->physicalAddr);
+  // Alone at the most urgent runnable level: there's nothing to switch to.
+  if (run_queues[__builtin_ctz(run_bitmap)] == task && task->next == task) {
+    return;
+  }
+  switch_task();
 }
 
 void move_stack(void *new_stack_start, uint32_t size) {
   int i;
+  // Unlike the heap, the stack is backed up front: a page fault on it
+  // could not be handled, since the CPU pushes the fault frame there.
   for (i = new_stack_start;
          i >= (int)new_stack_start - size; i -= 0x1000) {
     //monitor_write("\ndoing\n");
@@ -129,9 +252,6 @@ void move_stack(void *new_stack_start, uint32_t size) {
   monitor_write("\n");
   memset(new_stack_start - size, 0, size);
   monitor_write("\ncool\n");
-  uint32_t pd_addr;
-  asm volatile("mov %%cr3, %0" : "=r" (pd_addr));
-  asm volatile("mov %0, %%cr3" : : "r" (pd_addr));
 
   // Old ESP and EBP, read from registers.
   uint32_t old_stack_pointer;
@@ -168,6 +288,110 @@ void move_stack(void *new_stack_start, uint32_t size) {
   asm volatile("mov %0, %%ebp" : : "r" (new_base_pointer));
 }
 
+void set_priority(int priority) {
+  ASSERT(priority >= 0 && priority < TASK_PRIORITIES);
+  asm volatile("cli");
+  task_t *task = (task_t*)current_task;
+  dequeue(task);
+  task->priority = task->base_priority = priority;
+  task->ticks_left = timeslice(task);
+  enqueue(task);
+  // Something more urgent may be runnable now.
+  switch_task();
+  asm volatile("sti");
+}
+
+void set_timeslice(int ticks) {
+  ASSERT(ticks >= 0);
+  asm volatile("cli");
+  task_t *task = (task_t*)current_task;
+  task->timeslice = ticks;
+  task->ticks_left = timeslice(task);
+  asm volatile("sti");
+}
+
+void block_task() {
+  asm volatile("cli");
+  task_t *task = (task_t*)current_task;
+  task->state = TASK_BLOCKED;
+  dequeue(task);
+  // Giving up the CPU early is what interactive tasks do.
+  if (task->priority > task->base_priority) {
+    task->priority--;
+  }
+  switch_task();
+  asm volatile("sti");
+}
+
+void wake_task(task_t *task) {
+  u32int eflags;
+  asm volatile("pushf; pop %0; cli" : "=r"(eflags));
+  if (task->state == TASK_BLOCKED) {
+    task->state = TASK_RUNNABLE;
+    task->ticks_left = timeslice(task);
+    enqueue(task);
+  }
+  asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
+
+void sleep_task(u32int ticks) {
+  asm volatile("cli");
+  task_t *task = (task_t*)current_task;
+  task->wake_tick = tick + ticks;
+  task_t **pos = &sleepers;
+  while (*pos && (int)((*pos)->wake_tick - task->wake_tick) <= 0) {
+    pos = &(*pos)->sleep_next;
+  }
+  task->sleep_next = *pos;
+  *pos = task;
+  block_task();
+}
+
+void exit_task() {
+  asm volatile("cli");
+  task_t *task = (task_t*)current_task;
+  task->state = TASK_ZOMBIE;
+  dequeue(task);
+  fpu_exit(task);
+  switch_task();
+  PANIC("Zombie task scheduled");
+}
+
+void idle_wait() {
+  asm volatile("cli");
+  if (run_bitmap == 1u << IDLE_PRIORITY) {
+    // No one else can run before an interrupt wakes them, so the tick
+    // is only needed for the first sleeper's deadline, if there is one.
+    if (sleepers) {
+      int left = sleepers->wake_tick - tick;
+      timer_set_oneshot(left > 0 ? left : 1);
+    } else {
+      timer_stop();
+    }
+    // sti only takes effect after hlt, so no interrupt can slip in
+    // between and leave us halted with work to do.
+    asm volatile("sti; hlt; cli");
+    idle_wakeups++;
+  }
+  // Whatever woke us may have made a task runnable: run it now rather
+  // than waiting for a tick that isn't coming.
+  if ((int)__builtin_ctz(run_bitmap) < current_task->priority) {
+    timer_set_oneshot(1);
+    switch_task();
+  }
+  asm volatile("sti");
+}
+
+u32int get_idle_wakeups() {
+  return idle_wakeups;
+}
+
+int task_exists(int pid) {
+  // IDs are handed out in order and never reused; exited tasks linger as
+  // zombies.
+  return pid > 0 && (u32int)pid < next_pid;
+}
+
 int getpid() {
   return current_task->id;
 }
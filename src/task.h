@@ -3,28 +3,93 @@
 
 #include "common.h"
 #include "paging.h"
+#include "vma.h"
 
 #define KERNEL_STACK_SIZE 2048
 
+// Where initialise_tasking() moves the boot stack to, and its size.
+#define TASK_STACK_TOP 0xE0000000
+#define TASK_STACK_SIZE 0x5000
+
+// Scheduling priorities; 0 is the most urgent. The lowest one is left
+// for the idle task.
+#define TASK_PRIORITIES 32
+#define DEFAULT_PRIORITY 16
+#define IDLE_PRIORITY (TASK_PRIORITIES - 1)
+
+// Timeslices are counted in timer ticks. A task that uses up its slice
+// drops one priority level, where slices are longer; one that blocks
+// before then climbs back towards its base priority. Every BOOST_TICKS
+// all tasks return to their base, so CPU hogs can't starve for good.
+#define MIN_TIMESLICE 1
+#define BOOST_TICKS 100
+
+// Task states.
+#define TASK_RUNNABLE 0   // On a run queue, waiting for or using the CPU.
+#define TASK_BLOCKED  1   // Waiting for wake_task().
+#define TASK_ZOMBIE   2   // Exited, never scheduled again.
+
 // This structure defines a 'task' - a process.
 typedef struct task
 {
    int id;                // Process ID.
-   u32int esp, ebp;       // Stack and base pointers.
-   u32int eip;            // Instruction pointer.
+   u32int esp;            // Saved stack pointer, at a switch_context() frame.
    page_directory_t *page_directory; // Page directory.
-   struct task *next;     // The next task in a linked list.
+   int state;             // TASK_RUNNABLE, TASK_BLOCKED or TASK_ZOMBIE.
+   int priority;          // Which run queue the task is on.
+   int base_priority;     // The most urgent level the task can climb to.
+   int timeslice;         // Fixed slice length in ticks, or 0 for the
+                          // default of its priority level.
+   int ticks_left;        // What's left of the current slice.
+   struct task *next;     // The next and previous task on the same run
+   struct task *prev;     // queue, while runnable.
    uint32_t kernel_stack;
+   vma_t *vmas;           // Root of the tree of mapped areas.
+   uint32_t brk;          // Current program break.
+   u8int *fpu_state;      // Save area for the FPU/SSE registers. See
+                          // fpu.h.
+   u32int wake_tick;      // When to wake from sleep_task().
+   struct task *sleep_next; // The next task to wake, while sleeping.
 } task_t;
 
 // Initialises the tasking system.
 void initialise_tasking();
 
-// Called by the timer hook, this changes the running process.
-void task_switch();
+// Changes the running process.
+void switch_task();
+
+// Called by the timer hook, this charges the tick to the current task
+// and switches when its timeslice is up.
+void scheduler_tick();
+
+// Moves the current task to another base priority.
+void set_priority(int priority);
+
+// Sets the current task's timeslice, in ticks. 0 restores the default.
+void set_timeslice(int ticks);
+
+// Takes the current task off the CPU until wake_task() is called for it.
+void block_task();
+
+// Makes a blocked task runnable again.
+void wake_task(task_t *task);
+
+// Blocks the current task for at least ticks timer ticks.
+void sleep_task(u32int ticks);
+
+// Halts the CPU until the next interrupt if nothing else is runnable,
+// with the timer stopped. Called in a loop by the idle task.
+void idle_wait();
+
+// How many times idle_wait() has halted and been woken since boot.
+u32int get_idle_wakeups();
+
+// Ends the current task. It keeps its memory as a zombie, and this
+// never returns.
+void exit_task();
 
 // Forks the current process, spawning a new one with a different
-// memory space.
+// memory space. Returns -1 if the new task can't be set up.
 int fork();
 
 // Causes the current process' stack to be forcibly moved to a new location.
@@ -33,4 +98,7 @@ void move_stack(void *new_stack_start, uint32_t size);
 // Returns the pid of the current process.
 int getpid();
 
+// Whether pid names a task that has been created.
+int task_exists(int pid);
+
 #endif
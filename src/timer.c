@@ -6,12 +6,67 @@
 #include "monitor.h"
 #include "task.h"
 
+// The PIT's input clock, in Hz.
+#define PIT_FREQUENCY 1193180
+// Channel 0, low byte then high byte, mode 0 (interrupt on terminal count).
+#define PIT_ONESHOT 0x30
+
 u32int tick = 0;
 
-static void timer_callback(registers_t regs)
+// Timer interrupts taken, for telling an idle system from a busy one.
+u32int timer_interrupts = 0;
+
+// PIT counts per tick.
+static u32int tick_divisor;
+// Ticks until the programmed deadline, and how many of them the PIT is
+// counting down right now. A deadline further out than the 16 bit
+// counter can reach is covered in several shots.
+static u32int deadline_ticks = 0;
+static u32int shot_ticks = 0;
+
+static void program_shot()
+{
+    shot_ticks = deadline_ticks;
+    if (shot_ticks > 0xFFFF / tick_divisor) {
+        shot_ticks = 0xFFFF / tick_divisor;
+    }
+    u32int count = shot_ticks * tick_divisor;
+
+    outb(0x43, PIT_ONESHOT);
+    outb(0x40, (u8int)(count & 0xFF));
+    outb(0x40, (u8int)((count>>8) & 0xFF));
+}
+
+static void timer_callback(registers_t *regs)
+{
+    timer_interrupts++;
+    tick += shot_ticks;
+    deadline_ticks -= shot_ticks;
+    shot_ticks = 0;
+    if (deadline_ticks) {
+        program_shot();
+        return;
+    }
+
+    // The scheduler wants to see every tick while anything runs. The idle
+    // task stops the timer again when it has nothing to do.
+    timer_set_oneshot(1);
+    scheduler_tick();
+}
+
+void timer_set_oneshot(u32int ticks)
+{
+    ASSERT(ticks > 0);
+    deadline_ticks = ticks;
+    program_shot();
+}
+
+void timer_stop()
 {
-    tick++;
-    switch_task();
+    // Writing the mode without a count holds the counter until the next
+    // count comes, so nothing fires.
+    outb(0x43, PIT_ONESHOT);
+    deadline_ticks = shot_ticks = 0;
 }
 
 void init_timer(u32int frequency)
@@ -22,16 +77,8 @@ void init_timer(u32int frequency)
     // The value we send to the PIT is the value to divide it's input clock
     // (1193180 Hz) by, to get our required frequency. Important to note is
     // that the divisor must be small enough to fit into 16-bits.
-    u32int divisor = 1193180 / frequency;
-
-    // Send the command byte.
-    outb(0x43, 0x36);
-
-    // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-    u8int l = (u8int)(divisor & 0xFF);
-    u8int h = (u8int)( (divisor>>8) & 0xFF );
+    tick_divisor = PIT_FREQUENCY / frequency;
 
-    // Send the frequency divisor.
-    outb(0x40, l);
-    outb(0x40, h);
+    // There is no periodic mode: each interrupt programs the next one.
+    timer_set_oneshot(1);
 }
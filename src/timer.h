@@ -6,6 +6,23 @@
 
 #include "common.h"
 
+/** Ticks counted while the timer was running. **/
+extern u32int tick;
+/** Timer interrupts taken since boot. **/
+extern u32int timer_interrupts;
+
 void init_timer(u32int frequency);
 
+/**
+   Makes the timer interrupt once, ticks ticks from now. This replaces
+   any deadline that was already set.
+**/
+void timer_set_oneshot(u32int ticks);
+
+/**
+   Cancels the deadline; there are no timer interrupts until the next
+   timer_set_oneshot(). Ticks stop being counted meanwhile.
+**/
+void timer_stop();
+
 #endif
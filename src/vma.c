@@ -0,0 +1,270 @@
+// vma.c -- Per-task virtual memory areas.
+//
+// Nothing is mapped when an area is created. The page fault handler
+// asks vma_reserve() about faults on unmapped pages, and pages inside an
+// area get a zeroed frame on first touch like the kernel heap does.
+
+#include "vma.h"
+#include "task.h"
+#include "slab.h"
+#include "paging.h"
+#include "shm.h"
+
+extern volatile task_t *current_task;
+extern page_directory_t *current_directory;
+
+static kmem_cache_t *vma_cache;
+
+static int32_t height(vma_t *node) {
+  return node ? node->height : 0;
+}
+
+static void update_height(vma_t *node) {
+  int32_t left = height(node->left);
+  int32_t right = height(node->right);
+  node->height = (left > right ? left : right) + 1;
+}
+
+static vma_t *rotate_right(vma_t *node) {
+  vma_t *left = node->left;
+  node->left = left->right;
+  left->right = node;
+  update_height(node);
+  update_height(left);
+  return left;
+}
+
+static vma_t *rotate_left(vma_t *node) {
+  vma_t *right = node->right;
+  node->right = right->left;
+  right->left = node;
+  update_height(node);
+  update_height(right);
+  return right;
+}
+
+// Restore the AVL property at node after one of its subtrees changed
+// height by one, and return the new root of the subtree.
+static vma_t *balance(vma_t *node) {
+  update_height(node);
+  int32_t diff = height(node->left) - height(node->right);
+  if (diff > 1) {
+    if (height(node->left->left) < height(node->left->right)) {
+      node->left = rotate_left(node->left);
+    }
+    return rotate_right(node);
+  }
+  if (diff < -1) {
+    if (height(node->right->right) < height(node->right->left)) {
+      node->right = rotate_right(node->right);
+    }
+    return rotate_left(node);
+  }
+  return node;
+}
+
+static vma_t *tree_insert(vma_t *root, vma_t *vma) {
+  if (root == NULL) {
+    vma->left = vma->right = NULL;
+    vma->height = 1;
+    return vma;
+  }
+  if (vma->start < root->start) {
+    root->left = tree_insert(root->left, vma);
+  } else {
+    root->right = tree_insert(root->right, vma);
+  }
+  return balance(root);
+}
+
+// Unlink the leftmost node under node into *min.
+static vma_t *tree_remove_min(vma_t *node, vma_t **min) {
+  if (node->left == NULL) {
+    *min = node;
+    return node->right;
+  }
+  node->left = tree_remove_min(node->left, min);
+  return balance(node);
+}
+
+static vma_t *tree_remove(vma_t *root, vma_t *vma) {
+  if (vma->start < root->start) {
+    root->left = tree_remove(root->left, vma);
+  } else if (vma->start > root->start) {
+    root->right = tree_remove(root->right, vma);
+  } else {
+    if (root->right == NULL) {
+      return root->left;
+    }
+    vma_t *min;
+    vma_t *right = tree_remove_min(root->right, &min);
+    min->left = root->left;
+    min->right = right;
+    root = min;
+  }
+  return balance(root);
+}
+
+// Any area overlapping [start, end). Areas are disjoint, so each one
+// lies entirely to one side of a range it doesn't overlap.
+static vma_t *find_overlap(vma_t *node, uint32_t start, uint32_t end) {
+  while (node != NULL) {
+    if (end <= node->start) {
+      node = node->left;
+    } else if (start >= node->end) {
+      node = node->right;
+    } else {
+      return node;
+    }
+  }
+  return NULL;
+}
+
+static void add_vma(task_t *task, uint32_t start, uint32_t end,
+    shm_t *shm, uint32_t offset) {
+  vma_t *vma = (vma_t*)kmem_cache_alloc(vma_cache);
+  vma->start = start;
+  vma->end = end;
+  vma->shm = shm;
+  vma->offset = offset;
+  if (shm) {
+    shm_get(shm);
+  }
+  task->vmas = tree_insert(task->vmas, vma);
+}
+
+// Drop [start, end) from the current task's areas, splitting the ones
+// that stick out, and free whatever frames were behind it.
+static void unmap_range(uint32_t start, uint32_t end) {
+  task_t *task = (task_t*)current_task;
+  vma_t *vma;
+  while ((vma = find_overlap(task->vmas, start, end)) != NULL) {
+    task->vmas = tree_remove(task->vmas, vma);
+    if (vma->start < start) {
+      add_vma(task, vma->start, start, vma->shm, vma->offset);
+    }
+    if (vma->end > end) {
+      add_vma(task, end, vma->end, vma->shm,
+          vma->offset + (end - vma->start) / 0x1000);
+    }
+    if (vma->shm) {
+      shm_put(vma->shm);
+    }
+    kmem_cache_free(vma_cache, vma);
+  }
+
+  uint32_t page;
+  for (page = start; page < end; page += 0x1000) {
+    page_t *entry = get_page(page, 0, current_directory);
+    if (entry) {
+      free_frame(entry);
+    }
+  }
+  flush_tlb_range(start, end);
+}
+
+void initialise_vma() {
+  vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0, NULL);
+}
+
+vma_t *vma_clone(vma_t *root) {
+  if (root == NULL) {
+    return NULL;
+  }
+  vma_t *copy = (vma_t*)kmem_cache_alloc(vma_cache);
+  copy->start = root->start;
+  copy->end = root->end;
+  copy->shm = root->shm;
+  copy->offset = root->offset;
+  copy->height = root->height;
+  if (copy->shm) {
+    shm_get(copy->shm);
+  }
+  copy->left = vma_clone(root->left);
+  copy->right = vma_clone(root->right);
+  return copy;
+}
+
+int vma_reserve(uint32_t address) {
+  if (current_task == NULL) {
+    return 0;
+  }
+  vma_t *vma = find_overlap(current_task->vmas, address, address + 1);
+  if (vma == NULL) {
+    return 0;
+  }
+  page_t *page = get_page(address, 1, current_directory);
+  if (vma->shm) {
+    shm_map_page(vma->shm, vma->offset + (address - vma->start) / 0x1000,
+        page);
+  } else {
+    reserve_page(page, 0, 1);
+  }
+  return 1;
+}
+
+uint32_t mmap(uint32_t addr, uint32_t length) {
+  return vma_map(addr, length, NULL);
+}
+
+uint32_t vma_map(uint32_t addr, uint32_t length, shm_t *shm) {
+  task_t *task = (task_t*)current_task;
+  length = (length + 0xFFF) & 0xFFFFF000;
+  if (length == 0 || length > USER_MMAP_END - USER_MMAP_START) {
+    return 0;
+  }
+
+  addr &= 0xFFFFF000;
+  if (addr < USER_MMAP_START || addr > USER_MMAP_END - length ||
+      find_overlap(task->vmas, addr, addr + length) != NULL) {
+    // Lowest gap that fits, skipping over one area per step.
+    addr = USER_MMAP_START;
+    vma_t *vma;
+    while ((vma = find_overlap(task->vmas, addr, addr + length)) != NULL) {
+      addr = vma->end;
+      if (addr > USER_MMAP_END - length) {
+        return 0;
+      }
+    }
+  }
+
+  add_vma(task, addr, addr + length, shm, 0);
+  return addr;
+}
+
+int munmap(uint32_t addr, uint32_t length) {
+  uint32_t end = (addr + length + 0xFFF) & 0xFFFFF000;
+  addr &= 0xFFFFF000;
+  if (addr < USER_BRK_START || end > USER_MMAP_END || end < addr) {
+    return -1;
+  }
+  unmap_range(addr, end);
+  return 0;
+}
+
+uint32_t brk(uint32_t addr) {
+  task_t *task = (task_t*)current_task;
+  if (addr < USER_BRK_START || addr > USER_MMAP_START) {
+    return task->brk;
+  }
+
+  uint32_t old_end = (task->brk + 0xFFF) & 0xFFFFF000;
+  uint32_t new_end = (addr + 0xFFF) & 0xFFFFF000;
+  if (new_end > old_end) {
+    vma_t *heap = NULL;
+    if (old_end > USER_BRK_START) {
+      heap = find_overlap(task->vmas, old_end - 1, old_end);
+    }
+    if (heap) {
+      // The end isn't part of the key, so it can move in place.
+      heap->end = new_end;
+    } else {
+      add_vma(task, old_end, new_end, NULL, 0);
+    }
+  } else if (new_end < old_end) {
+    unmap_range(new_end, old_end);
+  }
+
+  task->brk = addr;
+  return addr;
+}
@@ -0,0 +1,76 @@
+// vma.h -- Per-task virtual memory areas: the anonymous mappings a task
+//          makes with mmap() and the program break it moves with brk().
+
+#ifndef VMA_H
+#define VMA_H
+
+#include "common.h"
+
+/**
+   The program break starts at USER_BRK_START and may grow up to
+   USER_MMAP_START. mmap() places mappings in the range above it.
+**/
+#define USER_BRK_START  0x10000000
+#define USER_MMAP_START 0x40000000
+#define USER_MMAP_END   0xC0000000
+
+struct shm;
+
+/**
+   One mapped range, kept in an AVL tree ordered by start address.
+   Areas never overlap, and pages in them are read-write. They are
+   private zeroed memory, or a window onto a shared memory object.
+**/
+typedef struct vma
+{
+  uint32_t start;       // First address, page aligned.
+  uint32_t end;         // One past the last address, page aligned.
+  struct shm *shm;      // Object mapped here, or NULL.
+  uint32_t offset;      // Page of shm that start maps.
+  struct vma *left;
+  struct vma *right;
+  int32_t height;       // Height of the subtree rooted here.
+} vma_t;
+
+/**
+   Sets up the cache areas are allocated from.
+**/
+void initialise_vma();
+
+/**
+   Returns a copy of the tree rooted at root, for a forked task.
+**/
+vma_t *vma_clone(vma_t *root);
+
+/**
+   Called on a fault at an unmapped address. If it lies inside one of
+   the current task's areas, non-zero is returned and the page is made
+   ready: shared memory is mapped at once, anything else is reserved so
+   the fault handler can give it a zeroed frame.
+**/
+int vma_reserve(uint32_t address);
+
+/**
+   As mmap, but the area maps shm if that isn't NULL.
+**/
+uint32_t vma_map(uint32_t addr, uint32_t length, struct shm *shm);
+
+/**
+   Maps length bytes of zeroed memory, at addr if that range is free or
+   wherever there is room otherwise. Returns the address, or 0.
+**/
+uint32_t mmap(uint32_t addr, uint32_t length);
+
+/**
+   Removes every mapping in [addr, addr + length) and frees its frames.
+   Returns 0, or -1 if the range is not in user space.
+**/
+int munmap(uint32_t addr, uint32_t length);
+
+/**
+   Moves the program break to addr and returns the new break. If addr
+   is 0 or out of range the break stays where it is.
+**/
+uint32_t brk(uint32_t addr);
+
+#endif // VMA_H
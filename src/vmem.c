@@ -0,0 +1,211 @@
+// vmem.c -- Page-granular allocations out of reserved ranges of kernel
+//           virtual memory, backed directly by frames.
+//
+// Page tables and page directories used to come from the general heap,
+// which had to carve page-aligned blocks out of unaligned holes and left
+// small fragments behind. They now come from here instead: a bitmap of
+// pages in a fixed range, with a second bitmap marking where each run
+// ends so free_pages() needs only the address.
+//
+// Large allocations get a second arena of the same kind, see vmalloc().
+// Its pages are only reserved and get their frames on first touch.
+
+#include "vmem.h"
+#include "kheap.h"
+#include "paging.h"
+
+#define BIT_WORD(a) ((a) / 32)
+#define BIT_MASK(a) (0x1 << ((a) % 32))
+
+extern page_directory_t *kernel_directory;
+
+static vmem_arena_t page_runs;
+static vmem_arena_t vmalloc_arena;
+
+static void arena_init(vmem_arena_t *arena, uint32_t start, uint32_t size) {
+  uint32_t words;
+
+  arena->start = start;
+  arena->pages = size / 0x1000;
+  words = (arena->pages + 31) / 32;
+  arena->used = (uint32_t*)kmalloc(words * sizeof(uint32_t));
+  arena->run_end = (uint32_t*)kmalloc(words * sizeof(uint32_t));
+  memset(arena->used, 0, words * sizeof(uint32_t));
+  memset(arena->run_end, 0, words * sizeof(uint32_t));
+  arena->hint = 0;
+  arena->pages_in_use = 0;
+}
+
+// First fit for count free pages with the run starting in [from, to) on
+// a multiple of align pages.
+static int32_t find_run(vmem_arena_t *arena, uint32_t count, uint32_t align,
+    uint32_t from, uint32_t to) {
+  uint32_t run = 0;
+  uint32_t i = from;
+  while (i < to + count - 1 && i < arena->pages) {
+    if (run == 0 && (i % align) != 0) {
+      i += align - i % align;
+      continue;
+    }
+    if ((i % 32) == 0 && arena->used[BIT_WORD(i)] == 0xFFFFFFFF) {
+      // Skip fully used words in one go.
+      run = 0;
+      i += 32;
+      continue;
+    }
+    if (arena->used[BIT_WORD(i)] & BIT_MASK(i)) {
+      run = 0;
+    } else if (++run == count) {
+      return i + 1 - count;
+    }
+    i++;
+  }
+  return -1;
+}
+
+static uint32_t arena_reserve(vmem_arena_t *arena, uint32_t count,
+    uint32_t align) {
+  int32_t first = find_run(arena, count, align, arena->hint, arena->pages);
+  if (first == -1) {
+    first = find_run(arena, count, align, 0, arena->hint);
+  }
+  if (first == -1) {
+    return 0;
+  }
+
+  uint32_t i;
+  for (i = first; i < first + count; i++) {
+    arena->used[BIT_WORD(i)] |= BIT_MASK(i);
+  }
+  i = first + count - 1;
+  arena->run_end[BIT_WORD(i)] |= BIT_MASK(i);
+
+  arena->hint = first + count;
+  if (arena->hint >= arena->pages) {
+    arena->hint = 0;
+  }
+  arena->pages_in_use += count;
+  return arena->start + first * 0x1000;
+}
+
+// Releases the run starting at addr and returns its length in pages.
+static uint32_t arena_release(vmem_arena_t *arena, uint32_t addr) {
+  uint32_t i = (addr - arena->start) / 0x1000;
+  uint32_t count = 0;
+  ASSERT(arena->used[BIT_WORD(i)] & BIT_MASK(i));
+
+  for (;;) {
+    uint32_t last = arena->run_end[BIT_WORD(i)] & BIT_MASK(i);
+    arena->used[BIT_WORD(i)] &= ~BIT_MASK(i);
+    arena->run_end[BIT_WORD(i)] &= ~BIT_MASK(i);
+    count++;
+    if (last) {
+      break;
+    }
+    i++;
+  }
+
+  arena->pages_in_use -= count;
+  return count;
+}
+
+// Length in pages of the run starting at addr.
+static uint32_t arena_run_length(vmem_arena_t *arena, uint32_t addr) {
+  uint32_t i = (addr - arena->start) / 0x1000;
+  uint32_t count = 1;
+  while (!(arena->run_end[BIT_WORD(i)] & BIT_MASK(i))) {
+    i++;
+    count++;
+  }
+  return count;
+}
+
+// Give the first count pages of the run at addr a frame each.
+static void map_run(uint32_t addr, uint32_t count) {
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    page_t *page = get_page(addr + i * 0x1000, 0, kernel_directory);
+    alloc_frame(page, 1, 1);
+    page->global = 1;
+  }
+}
+
+// Reserve count pages starting at addr; each gets a zeroed frame when
+// it is first touched.
+static void reserve_run(uint32_t addr, uint32_t count) {
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    reserve_page(get_page(addr + i * 0x1000, 0, kernel_directory), 1, 1);
+  }
+}
+
+// Unmap count pages starting at addr and free whatever frames they had.
+static void unmap_run(uint32_t addr, uint32_t count) {
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    free_frame(get_page(addr + i * 0x1000, 0, kernel_directory));
+  }
+  flush_tlb_range(addr, addr + count * 0x1000);
+}
+
+void initialise_vmem() {
+  arena_init(&page_runs, PAGE_RUN_START, PAGE_RUN_SIZE);
+  arena_init(&vmalloc_arena, VMALLOC_START, VMALLOC_SIZE);
+}
+
+int is_page_run(uint32_t addr) {
+  return addr >= PAGE_RUN_START && addr < PAGE_RUN_START + PAGE_RUN_SIZE;
+}
+
+uint32_t alloc_pages(uint32_t count) {
+  return alloc_pages_aligned(count, 1);
+}
+
+uint32_t alloc_pages_aligned(uint32_t count, uint32_t align) {
+  uint32_t addr = arena_reserve(&page_runs, count, align);
+  if (addr == 0) {
+    PANIC("Out of page-run space");
+  }
+  map_run(addr, count);
+  return addr;
+}
+
+void free_pages(uint32_t addr) {
+  ASSERT((addr & 0xFFF) == 0);
+  unmap_run(addr, arena_release(&page_runs, addr));
+}
+
+int is_vmalloc(uint32_t addr) {
+  return addr >= VMALLOC_START && addr < VMALLOC_START + VMALLOC_SIZE;
+}
+
+uint32_t vmalloc(uint32_t size) {
+  uint32_t count = (size + 0xFFF) / 0x1000;
+  // Reserve one extra page and leave it unmapped, so running off the end
+  // of the buffer faults instead of corrupting the next one.
+  uint32_t addr = arena_reserve(&vmalloc_arena, count + 1, 1);
+  if (addr == 0) {
+    PANIC("Out of vmalloc space");
+  }
+  // Large buffers are often only partly used, so back them on demand.
+  reserve_run(addr, count);
+  return addr;
+}
+
+uint32_t vzalloc(uint32_t size) {
+  // Demand-paged frames are zeroed when they are first touched.
+  return vmalloc(size);
+}
+
+uint32_t vmem_size(uint32_t addr) {
+  if (is_vmalloc(addr)) {
+    // Don't count the guard page.
+    return (arena_run_length(&vmalloc_arena, addr) - 1) * 0x1000;
+  }
+  return arena_run_length(&page_runs, addr) * 0x1000;
+}
+
+void vfree(uint32_t addr) {
+  ASSERT((addr & 0xFFF) == 0);
+  unmap_run(addr, arena_release(&vmalloc_arena, addr));
+}
@@ -0,0 +1,96 @@
+// vmem.h -- Page-granular allocations out of reserved ranges of kernel
+//           virtual memory, backed directly by frames.
+
+#ifndef VMEM_H
+#define VMEM_H
+
+#include "common.h"
+
+/**
+   Range of kernel virtual memory set aside for page runs. Its page
+   tables are created at boot, so every page directory shares them.
+**/
+#define PAGE_RUN_START 0xD0000000
+#define PAGE_RUN_SIZE  0x04000000
+
+/**
+   Range of kernel virtual memory for large allocations, see vmalloc().
+   Like the page-run range, its page tables are created at boot.
+**/
+#define VMALLOC_START  0xD4000000
+#define VMALLOC_SIZE   0x08000000
+
+/**
+   kmalloc() requests of at least this many bytes go to vmalloc().
+**/
+#define VMALLOC_THRESHOLD 0x10000
+
+/**
+   A range of kernel virtual memory handed out in runs of whole pages.
+**/
+typedef struct {
+  uint32_t start;
+  uint32_t pages;
+  uint32_t *used;     // One bit per page, set if the page is allocated.
+  uint32_t *run_end;  // One bit per page, set on the last page of a run.
+  uint32_t hint;      // Page to start the next search from.
+  uint32_t pages_in_use;
+} vmem_arena_t;
+
+/**
+   Sets up the page-run and vmalloc arenas. Must be called once the
+   kernel heap exists.
+**/
+void initialise_vmem();
+
+/**
+   Returns non-zero if addr was handed out by alloc_pages().
+**/
+int is_page_run(uint32_t addr);
+
+/**
+   Allocate count contiguous, page-aligned pages of kernel memory. Each
+   page gets its own frame, so the run is only virtually contiguous.
+**/
+uint32_t alloc_pages(uint32_t count);
+
+/**
+   As alloc_pages, but the run starts on a multiple of align pages.
+**/
+uint32_t alloc_pages_aligned(uint32_t count, uint32_t align);
+
+/**
+   Unmap a run returned by alloc_pages() and free its frames.
+**/
+void free_pages(uint32_t addr);
+
+/**
+   Returns non-zero if addr was handed out by vmalloc().
+**/
+int is_vmalloc(uint32_t addr);
+
+/**
+   Allocate size bytes in a virtual range of their own, followed by an
+   unmapped guard page. Large buffers never touch the heap, so they
+   neither fragment it nor make it grow. Pages get a zeroed frame the
+   first time they are touched.
+**/
+uint32_t vmalloc(uint32_t size);
+
+/**
+   As vmalloc, but guaranteed to read as zero.
+**/
+uint32_t vzalloc(uint32_t size);
+
+/**
+   Returns the number of usable bytes behind addr, which must have come
+   from alloc_pages() or vmalloc().
+**/
+uint32_t vmem_size(uint32_t addr);
+
+/**
+   Unmap an allocation returned by vmalloc() and free its frames.
+**/
+void vfree(uint32_t addr);
+
+#endif // VMEM_H